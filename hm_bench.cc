@@ -0,0 +1,458 @@
+/* HmSearch hash library - benchmark tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <kcthread.h>
+
+#include "hmsearch.h"
+
+// Number of hashes buffered before writing them to the database,
+// the same as hm_insert uses
+#define WRITE_BUFFER_SIZE 100000
+
+/** Deterministic pseudo-random numbers (splitmix64), so that a given
+ * seed always produces the same dataset and queries.
+ */
+class Random
+{
+public:
+    Random(uint64_t seed) : _state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    unsigned below(unsigned n) {
+        return next() % n;
+    }
+
+private:
+    uint64_t _state;
+};
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static HmSearch::hash_string random_hash(Random& rnd, int hash_bytes)
+{
+    HmSearch::hash_string hash(hash_bytes, 0);
+    for (int i = 0; i < hash_bytes; i++) {
+        hash[i] = rnd.next() & 0xff;
+    }
+    return hash;
+}
+
+/** Flip exactly count distinct bits of hash.
+ */
+static void flip_bits(Random& rnd, HmSearch::hash_string& hash, unsigned count)
+{
+    std::vector<bool> flipped(hash.length() * 8);
+
+    while (count > 0) {
+        unsigned bit = rnd.below(flipped.size());
+        if (!flipped[bit]) {
+            flipped[bit] = true;
+            hash[bit / 8] ^= 1 << (bit % 8);
+            count--;
+        }
+    }
+}
+
+/** Generate the dataset.  With clusters > 0 each hash is a random
+ * cluster centre with up to radius bits flipped, so many hashes share
+ * partition values like near-duplicate images do.
+ */
+static void generate_hashes(Random& rnd, int hash_bytes, size_t count,
+                            size_t clusters, unsigned radius,
+                            std::vector<HmSearch::hash_string>& hashes)
+{
+    std::vector<HmSearch::hash_string> centres;
+    for (size_t i = 0; i < clusters; i++) {
+        centres.push_back(random_hash(rnd, hash_bytes));
+    }
+
+    hashes.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        if (centres.empty()) {
+            hashes.push_back(random_hash(rnd, hash_bytes));
+        }
+        else {
+            hashes.push_back(centres[rnd.below(centres.size())]);
+            flip_bits(rnd, hashes.back(), rnd.below(radius + 1));
+        }
+    }
+}
+
+
+/** Runs a share of the queries, timing each lookup.
+ */
+struct LookupWorker : public kyotocabinet::Thread {
+    LookupWorker() : db(NULL), queries(NULL), first(0), end(0), ok(true) {}
+
+    void run() {
+        HmSearch::LookupResultList result;
+
+        for (size_t i = first; i < end; i++) {
+            result.clear();
+
+            double start = now();
+            if (!db->lookup((*queries)[i], result, -1, &error, &stats)) {
+                ok = false;
+                return;
+            }
+            latencies.push_back(now() - start);
+        }
+    }
+
+    HmSearch* db;
+    const std::vector<HmSearch::hash_string>* queries;
+    size_t first;
+    size_t end;
+
+    bool ok;
+    std::string error;
+    std::vector<double> latencies;
+    HmSearch::LookupStats stats;
+};
+
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    size_t i = (size_t) (p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+/** Look up the queries on a number of threads, printing one result
+ * line.  Returns false on lookup errors.
+ */
+static bool bench_lookups(const char* prog, HmSearch* db, int threads,
+                          unsigned distance,
+                          const std::vector<HmSearch::hash_string>& queries)
+{
+    std::vector<LookupWorker*> workers;
+
+    double start = now();
+
+    for (int t = 0; t < threads; t++) {
+        LookupWorker* w = new LookupWorker;
+        w->db = db;
+        w->queries = &queries;
+        w->first = queries.size() * t / threads;
+        w->end = queries.size() * (t + 1) / threads;
+        w->latencies.reserve(w->end - w->first);
+        workers.push_back(w);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        workers[t]->start();
+    }
+
+    for (int t = 0; t < threads; t++) {
+        workers[t]->join();
+    }
+
+    double seconds = now() - start;
+
+    std::vector<double> latencies;
+    HmSearch::LookupStats stats;
+    bool ok = true;
+
+    for (int t = 0; t < threads; t++) {
+        const LookupWorker* w = workers[t];
+
+        if (!w->ok && ok) {
+            fprintf(stderr, "%s: cannot lookup hash: %s\n", prog, w->error.c_str());
+            ok = false;
+        }
+
+        stats.add(w->stats);
+
+        latencies.insert(latencies.end(), w->latencies.begin(), w->latencies.end());
+        delete w;
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double n = queries.empty() ? 1 : queries.size();
+
+    printf("{\"test\": \"lookup\", \"threads\": %d, \"distance\": %u, "
+           "\"queries\": %zu, \"seconds\": %.6f, \"queries_per_second\": %.1f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+           "\"probes\": %.2f, \"probe_hits\": %.2f, \"posting_bytes\": %.1f, "
+           "\"candidates\": %.2f, "
+           "\"filtered\": %.2f, \"false_positives\": %.2f, \"matches\": %.2f}\n",
+           threads, distance, queries.size(), seconds, queries.size() / seconds,
+           percentile(latencies, 0.5) * 1e6,
+           percentile(latencies, 0.99) * 1e6,
+           percentile(latencies, 0.999) * 1e6,
+           stats.probes / n, stats.probe_hits / n, stats.posting_bytes / n,
+           stats.candidates / n,
+           stats.filtered / n, stats.false_positives / n, stats.matches / n);
+    fflush(stdout);
+
+    return true;
+}
+
+/** Parse a comma-separated list of numbers.  Returns false if any of
+ * them is not a number.
+ */
+static bool parse_list(const char* arg, std::vector<unsigned>& values)
+{
+    values.clear();
+
+    while (*arg) {
+        char* end;
+        values.push_back(strtoul(arg, &end, 10));
+
+        if (end == arg || (*end && *end != ',')) {
+            return false;
+        }
+
+        arg = *end ? end + 1 : end;
+    }
+
+    return !values.empty();
+}
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s seed] [-n hashes] [-q queries] [-c clusters] [-r radius]\n"
+            "       [-d distances] [-j threads] [-i id_bits] [-z] [-S shards] [-m] [-u]\n"
+            "       path hash_bits max_error\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed = 1;
+    size_t num_hashes = 100000;
+    size_t num_queries = 10000;
+    size_t clusters = 0;
+    unsigned radius = 0;
+    std::vector<unsigned> distances;
+    std::vector<unsigned> thread_counts(1, 1);
+    unsigned id_bits = 0;
+    unsigned flags = 0;
+    unsigned shards = 0;
+    HmSearch::OpenMode mode = HmSearch::READONLY;
+    bool buffered = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:q:c:r:d:j:i:zS:mu")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            num_hashes = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'q':
+            num_queries = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            clusters = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'r':
+            radius = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'd':
+            if (!parse_list(optarg, distances)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'j':
+            if (!parse_list(optarg, thread_counts)
+                || std::count(thread_counts.begin(), thread_counts.end(), 0u)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'i':
+            id_bits = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'z':
+            flags |= HmSearch::COMPRESS_CHUNKS;
+            break;
+
+        case 'S':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'm':
+            mode = HmSearch::MEMORY;
+            break;
+
+        case 'u':
+            buffered = false;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3 || num_hashes == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    unsigned hash_bits = strtoul(argv[optind + 1], NULL, 10);
+    unsigned max_error = strtoul(argv[optind + 2], NULL, 10);
+
+    // flip_bits() can't flip more distinct bits than a hash has
+    if (radius > hash_bits) {
+        fprintf(stderr, "%s: radius must not exceed hash_bits\n", argv[0]);
+        return 1;
+    }
+
+    // By default query exact duplicates, hashes halfway to the max
+    // error, at the max error, and just beyond it
+    if (distances.empty()) {
+        distances.push_back(0);
+        distances.push_back(max_error / 2);
+        distances.push_back(max_error);
+        distances.push_back(max_error + 1);
+    }
+
+    std::string error_msg;
+
+    std::vector<HmSearch::hash_string> no_sample;
+
+    if (!(shards ?
+          HmSearch::init_sharded(path, shards, hash_bits, max_error, num_hashes, id_bits,
+                                 no_sample, flags, &error_msg) :
+          id_bits ?
+          HmSearch::init_compact(path, hash_bits, max_error, num_hashes, id_bits,
+                                 no_sample, flags, &error_msg) :
+          HmSearch::init(path, hash_bits, max_error, num_hashes, no_sample, flags,
+                         &error_msg))) {
+        fprintf(stderr, "%s: error initialising %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    printf("{\"test\": \"config\", \"seed\": %llu, \"hash_bits\": %u, \"max_error\": %u, "
+           "\"hashes\": %zu, \"queries\": %zu, \"clusters\": %zu, \"radius\": %u, "
+           "\"id_bits\": %u, \"compressed\": %s, \"shards\": %u, \"memory\": %s, "
+           "\"buffered\": %s}\n",
+           (unsigned long long) seed, hash_bits, max_error,
+           num_hashes, num_queries, clusters, radius,
+           id_bits, flags & HmSearch::COMPRESS_CHUNKS ? "true" : "false", shards,
+           mode == HmSearch::MEMORY ? "true" : "false",
+           buffered ? "true" : "false");
+
+    Random rnd(seed);
+    int hash_bytes = hash_bits / 8;
+    std::vector<HmSearch::hash_string> hashes;
+
+    generate_hashes(rnd, hash_bytes, num_hashes, clusters, radius, hashes);
+
+    // Insert one hash at a time through the write buffer, like
+    // hm_insert does, or straight to the database with -u
+    {
+        std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, &error_msg));
+        if (!db.get()) {
+            fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+            return 1;
+        }
+
+        double start = now();
+
+        if (buffered && !db->set_write_buffer(WRITE_BUFFER_SIZE, &error_msg)) {
+            fprintf(stderr, "%s: cannot set write buffer: %s\n", argv[0], error_msg.c_str());
+            return 1;
+        }
+
+        for (size_t i = 0; i < hashes.size(); i++) {
+            if (!db->insert(hashes[i], &error_msg)) {
+                fprintf(stderr, "%s: cannot insert hash: %s\n", argv[0], error_msg.c_str());
+                return 1;
+            }
+        }
+
+        if (!db->close(&error_msg)) {
+            fprintf(stderr, "%s: error closing %s: %s\n", argv[0], path, error_msg.c_str());
+            return 1;
+        }
+
+        double seconds = now() - start;
+
+        printf("{\"test\": \"insert\", \"hashes\": %zu, \"seconds\": %.6f, "
+               "\"hashes_per_second\": %.1f}\n",
+               hashes.size(), seconds, hashes.size() / seconds);
+        fflush(stdout);
+    }
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, mode, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    for (size_t d = 0; d < distances.size(); d++) {
+        std::vector<HmSearch::hash_string> queries;
+        queries.reserve(num_queries);
+
+        for (size_t i = 0; i < num_queries; i++) {
+            queries.push_back(hashes[rnd.below(hashes.size())]);
+            flip_bits(rnd, queries.back(), std::min(distances[d], hash_bits));
+        }
+
+        for (size_t t = 0; t < thread_counts.size(); t++) {
+            if (!bench_lookups(argv[0], db.get(), thread_counts[t],
+                               distances[d], queries)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
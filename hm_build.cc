@@ -0,0 +1,119 @@
+/* HmSearch hash library - bulk database build tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "hmsearch.h"
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-b] [-m memory_mb] path hash_bits max_error [input]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    bool binary = false;
+    size_t memory_mb = 256;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "bm:")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = true;
+            break;
+
+        case 'm':
+            memory_mb = strtoul(optarg, NULL, 10);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 3 || argc - optind > 4 || memory_mb == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    unsigned hash_bits = strtoul(argv[optind + 1], NULL, 10);
+    unsigned max_error = strtoul(argv[optind + 2], NULL, 10);
+    const char *input_path = argc - optind > 3 ? argv[optind + 3] : NULL;
+
+    std::string error_msg;
+
+    std::auto_ptr<HmSearch::Builder> builder(
+        HmSearch::create_builder(path, hash_bits, max_error,
+                                 memory_mb << 20, &error_msg));
+    if (!builder.get()) {
+        fprintf(stderr, "%s: error building %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    std::ifstream input_file;
+    std::istream* input = &std::cin;
+
+    if (input_path) {
+        input_file.open(input_path, std::ios::in | std::ios::binary);
+        if (!input_file) {
+            fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], input_path, strerror(errno));
+            return 1;
+        }
+        input = &input_file;
+    }
+
+    if (binary) {
+        // Raw hashes back-to-back, hash_bits / 8 bytes each
+        std::vector<char> hash(hash_bits / 8);
+
+        while (input->read(&hash[0], hash.size())) {
+            HmSearch::hash_string h((const uint8_t*) &hash[0], hash.size());
+            if (!builder->add(h, &error_msg)) {
+                fprintf(stderr, "%s: cannot add hash: %s (%s)\n",
+                        argv[0], error_msg.c_str(), HmSearch::format_hexhash(h).c_str());
+                return 1;
+            }
+        }
+
+        if (input->gcount() != 0) {
+            fprintf(stderr, "%s: ignoring incomplete hash at end of input\n", argv[0]);
+        }
+    }
+    else {
+        std::string hexhash;
+        while (*input >> hexhash) {
+            if (!builder->add(HmSearch::parse_hexhash(hexhash), &error_msg)) {
+                fprintf(stderr, "%s: cannot add hash: %s (%s)\n",
+                        argv[0], error_msg.c_str(), hexhash.c_str());
+            }
+        }
+    }
+
+    if (!builder->finish(&error_msg)) {
+        fprintf(stderr, "%s: error building %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
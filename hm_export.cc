@@ -0,0 +1,36 @@
+/* HmSearch hash library - mapped database export tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hmsearch.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s path mapped_path\n", argv[0]);
+        return 1;
+    }
+
+    const char* path = argv[1];
+    const char* mapped_path = argv[2];
+    std::string error_msg;
+
+    if (!HmSearch::export_mapped(path, mapped_path, &error_msg)) {
+        fprintf(stderr, "%s: error exporting %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
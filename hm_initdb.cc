@@ -7,28 +7,95 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <vector>
 
 #include "hmsearch.h"
 
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-i id_bits] [-s sample] [-z] [-S shards] path hash_bits max_error num_hashes\n", prog);
+}
+
 int main(int argc, char **argv)
 {
     const char *path;
     unsigned hash_bits;
     unsigned max_error;
     uint64_t num_hashes;
-    
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s path hash_bits max_error num_hashes\n", argv[0]);
+    unsigned id_bits = 0;
+    const char *sample_path = NULL;
+    unsigned flags = 0;
+    unsigned shards = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:s:zS:")) != -1) {
+        switch (opt) {
+        case 'i':
+            id_bits = strtoul(optarg, NULL, 10);
+            break;
+
+        case 's':
+            sample_path = optarg;
+            break;
+
+        case 'z':
+            flags |= HmSearch::COMPRESS_CHUNKS;
+            break;
+
+        case 'S':
+            shards = strtoul(optarg, NULL, 10);
+            if (shards == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 4) {
+        usage(argv[0]);
         return 1;
     }
 
-    path = argv[1];
-    hash_bits = strtoul(argv[2], NULL, 10);
-    max_error = strtoul(argv[3], NULL, 10);
-    num_hashes = strtoull(argv[4], NULL, 10);
+    path = argv[optind];
+    hash_bits = strtoul(argv[optind + 1], NULL, 10);
+    max_error = strtoul(argv[optind + 2], NULL, 10);
+    num_hashes = strtoull(argv[optind + 3], NULL, 10);
+
+    // Hexadecimal hashes to balance the partitions for
+    std::vector<HmSearch::hash_string> sample;
+
+    if (sample_path) {
+        std::ifstream sample_file(sample_path);
+        if (!sample_file) {
+            fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], sample_path, strerror(errno));
+            return 1;
+        }
+
+        std::string hexhash;
+        while (sample_file >> hexhash) {
+            sample.push_back(HmSearch::parse_hexhash(hexhash));
+        }
+    }
 
     std::string error_msg;
-    if (!HmSearch::init(path, hash_bits, max_error, num_hashes, &error_msg)) {
+    bool ok = (shards ?
+               HmSearch::init_sharded(path, shards, hash_bits, max_error, num_hashes, id_bits,
+                                      sample, flags, &error_msg) :
+               id_bits ?
+               HmSearch::init_compact(path, hash_bits, max_error, num_hashes, id_bits,
+                                      sample, flags, &error_msg) :
+               HmSearch::init(path, hash_bits, max_error, num_hashes, sample, flags,
+                              &error_msg));
+    if (!ok) {
         fprintf(stderr, "%s: error initalising %s: %s\n", argv[0], path, error_msg.c_str());
         return 1;
     }
@@ -6,20 +6,48 @@
 
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <memory>
+#include <vector>
 
 #include "hmsearch.h"
 
+// Number of stdin hashes buffered before writing them to the database
+#define WRITE_BUFFER_SIZE 100000
+
+// Number of raw hashes read from stdin at a time in binary mode
+#define READ_BLOCK_SIZE 4096
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-b] path [hexhash...]\n", prog);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s path [hexhash...]\n", argv[0]);
+    bool binary = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *path = argv[1];
+    const char *path = argv[optind];
     std::string error_msg;
     
     std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, &error_msg));
@@ -28,9 +56,9 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if (argc > 2) {
+    if (optind + 1 < argc) {
         // Insert hashes from command line
-        for (int i = 2; i < argc; i++) {
+        for (int i = optind + 1; i < argc; i++) {
             const char *hexhash = argv[i];
             if (!db->insert(HmSearch::parse_hexhash(hexhash), &error_msg)) {
                 fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
@@ -39,12 +67,46 @@ int main(int argc, char **argv)
         }
     }
     else {
-        // Read hashes from stdin
-        std::string hexhash;
-        while (std::cin >> hexhash) {
-            if (!db->insert(HmSearch::parse_hexhash(hexhash), &error_msg)) {
-                fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
-                        argv[0], error_msg.c_str(), hexhash.c_str());
+        // Read hashes from stdin, buffering them to write each
+        // partition key once per buffer instead of once per hash
+        if (!db->set_write_buffer(WRITE_BUFFER_SIZE, &error_msg)) {
+            fprintf(stderr, "%s: cannot set write buffer: %s\n",
+                    argv[0], error_msg.c_str());
+            return 1;
+        }
+
+        if (binary) {
+            // Raw hashes back-to-back, hash_bits / 8 bytes each
+            size_t hash_bytes = db->hash_bits() / 8;
+            std::vector<uint8_t> block(hash_bytes * READ_BLOCK_SIZE);
+            size_t count;
+
+            // fread() only returns a short block at the end of input
+            while ((count = fread(&block[0], 1, block.size(), stdin)) > 0) {
+                for (size_t i = 0; i + hash_bytes <= count; i += hash_bytes) {
+                    HmSearch::hash_string hash(&block[i], hash_bytes);
+                    if (!db->insert(hash, &error_msg)) {
+                        fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
+                                argv[0], error_msg.c_str(),
+                                HmSearch::format_hexhash(hash).c_str());
+                    }
+                }
+
+                if (count % hash_bytes != 0) {
+                    fprintf(stderr, "%s: ignoring incomplete hash at end of input\n", argv[0]);
+                    break;
+                }
+            }
+        }
+        else {
+            std::ios::sync_with_stdio(false);
+
+            std::string hexhash;
+            while (std::cin >> hexhash) {
+                if (!db->insert(HmSearch::parse_hexhash(hexhash), &error_msg)) {
+                    fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
+                            argv[0], error_msg.c_str(), hexhash.c_str());
+                }
             }
         }
     }
@@ -5,66 +5,834 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include <iostream>
+#include <deque>
+#include <map>
 #include <memory>
+#include <vector>
+
+#include <kcthread.h>
 
 #include "hmsearch.h"
+#include "hm_protocol.h"
+
+// Number of stdin hashes looked up together with HmSearch::lookup_batch()
+#define BATCH_SIZE 1024
+
+/** A batch of stdin hashes, and the output of looking them up.
+ *
+ * In binary mode the hashes are raw bytes, and the output for each
+ * hash is the number of matches as a uint32_t followed by each
+ * matching hash and its distance as a uint16_t, in native byte
+ * order.
+ */
+struct Chunk {
+    Chunk(bool b, size_t n) : seq(0), binary(b), nearest(n), ok(true) {}
+
+    uint64_t seq;
+    bool binary;
+
+    // If non-zero, only this many of the closest matches are output
+    size_t nearest;
+
+    std::vector<std::string> inputs;
+    std::string output;
+
+    // Set if a lookup failed, after which no more hashes are looked up
+    bool ok;
+    std::string error;
+};
+
+static HmSearch::hash_string parse_input(const std::string& input, bool binary)
+{
+    if (binary) {
+        return HmSearch::hash_string((const uint8_t*) input.data(), input.length());
+    }
+
+    return HmSearch::parse_hexhash(input);
+}
+
+/** Appends the matches of one lookup to an output buffer as they are
+ * found.  In binary mode the match count is filled in by finish().
+ */
+class MatchFormatter : public HmSearch::LookupCallback
+{
+public:
+    MatchFormatter(size_t hash_bytes, bool binary, std::string& output)
+        : _hash_bytes(hash_bytes)
+        , _binary(binary)
+        , _output(output)
+        , _start(output.length())
+        , _count(0)
+        {
+            if (_binary) {
+                _output.append(sizeof(_count), '\0');
+            }
+        }
+
+    bool match(const uint8_t* hash, int distance) {
+        _count++;
+
+        if (_binary) {
+            uint16_t d = distance;
+            _output.append((const char*) hash, _hash_bytes);
+            _output.append((const char*) &d, sizeof(d));
+            return true;
+        }
+
+        char line[16];
+        size_t hex_length = _hash_bytes * 2;
+        int length = snprintf(line, sizeof(line), " %d\n", distance);
+
+        _output.resize(_output.length() + hex_length);
+        HmSearch::format_hexhash(hash, _hash_bytes,
+                                 &_output[_output.length() - hex_length]);
+        _output.append(line, length);
+        return true;
+    }
+
+    void finish() {
+        if (_binary) {
+            memcpy(&_output[_start], &_count, sizeof(_count));
+        }
+    }
+
+    /** Remove anything output so far, if the lookup failed. */
+    void discard() {
+        _output.resize(_start);
+    }
+
+private:
+    size_t _hash_bytes;
+    bool _binary;
+    std::string& _output;
+    size_t _start;
+    uint32_t _count;
+};
+
+static void format_matches(const HmSearch::LookupResultList& matches,
+                           size_t hash_bytes, bool binary, std::string& output)
+{
+    MatchFormatter formatter(hash_bytes, binary, output);
+
+    for (HmSearch::LookupResultList::const_iterator i = matches.begin();
+         i != matches.end();
+         ++i) {
+        formatter.match(i->hash.data(), i->distance);
+    }
+
+    formatter.finish();
+}
+
+static bool lookup(HmSearch* db, const std::string& input, bool binary,
+                   size_t nearest, std::string& output, std::string& error)
+{
+    std::string error_msg;
+    HmSearch::hash_string query = parse_input(input, binary);
+    bool ok;
+
+    if (nearest) {
+        HmSearch::LookupResultList matches;
+        ok = db->lookup_nearest(query, nearest, matches, -1, &error_msg);
+        if (ok) {
+            format_matches(matches, query.length(), binary, output);
+        }
+    }
+    else {
+        // Format the matches directly instead of collecting them first
+        MatchFormatter formatter(query.length(), binary, output);
+        ok = db->lookup(query, formatter, -1, &error_msg);
+        if (ok) {
+            formatter.finish();
+        }
+        else {
+            formatter.discard();
+        }
+    }
+
+    if (!ok) {
+        error = ("cannot lookup hash: " + error_msg + " ("
+                 + (binary ? HmSearch::format_hexhash(query) : input) + ")");
+        return false;
+    }
+
+    return true;
+}
+
+static void lookup_chunk(HmSearch* db, Chunk& chunk)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::vector<HmSearch::LookupResultList> results;
+
+    for (size_t i = 0; i < chunk.inputs.size(); i++) {
+        queries.push_back(parse_input(chunk.inputs[i], chunk.binary));
+    }
+
+    // Nearest-match lookups are done one hash at a time, as are
+    // batches that failed to report which hash it was
+    if (chunk.nearest || !db->lookup_batch(queries, results)) {
+        for (size_t i = 0; i < chunk.inputs.size(); i++) {
+            if (!lookup(db, chunk.inputs[i], chunk.binary, chunk.nearest,
+                        chunk.output, chunk.error)) {
+                chunk.ok = false;
+                return;
+            }
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < results.size(); i++) {
+        format_matches(results[i], queries[i].length(), chunk.binary, chunk.output);
+    }
+}
+
+/** Read the next batch of hashes from stdin into chunk.  Returns
+ * false at the end of input.
+ */
+static bool read_chunk(const char* prog, Chunk& chunk, size_t hash_bytes)
+{
+    if (chunk.binary) {
+        // Raw hashes back-to-back, read a whole batch at a time.
+        // fread() only returns a short block at the end of input.
+        std::string block(hash_bytes * BATCH_SIZE, '\0');
+        size_t count = fread(&block[0], 1, block.size(), stdin);
+
+        for (size_t i = 0; i + hash_bytes <= count; i += hash_bytes) {
+            chunk.inputs.push_back(block.substr(i, hash_bytes));
+        }
+
+        if (count % hash_bytes != 0) {
+            fprintf(stderr, "%s: ignoring incomplete hash at end of input\n", prog);
+        }
+    }
+    else {
+        std::string hexhash;
+
+        while (chunk.inputs.size() < BATCH_SIZE && std::cin >> hexhash) {
+            chunk.inputs.push_back(hexhash);
+        }
+    }
+
+    return !chunk.inputs.empty();
+}
+
+static bool write_chunk(const char* prog, const Chunk& chunk)
+{
+    std::cout.write(chunk.output.data(), chunk.output.length());
+    std::cout.flush();
+
+    if (!chunk.ok) {
+        fprintf(stderr, "%s: %s\n", prog, chunk.error.c_str());
+    }
+
+    return chunk.ok;
+}
+
+
+/** Looks up chunks of hashes on a pool of worker threads, while a
+ * writer thread outputs the results either in the order the chunks
+ * were added or in the order they complete.
+ *
+ * At most two chunks per worker are in flight at any time, so the
+ * reader is held back when the workers or the writer fall behind.
+ */
+class LookupPipeline
+{
+public:
+    LookupPipeline(const char* prog, HmSearch* db, int threads, bool ordered)
+        : _prog(prog)
+        , _db(db)
+        , _ordered(ordered)
+        , _max_in_flight(2 * threads)
+        , _in_flight(0)
+        , _next_seq(0)
+        , _next_write(0)
+        , _closing(false)
+        , _failed(false)
+        {
+            for (int i = 0; i < threads; i++) {
+                _workers.push_back(new Worker);
+                _workers.back()->pipeline = this;
+                _workers.back()->start();
+            }
+            _writer.pipeline = this;
+            _writer.start();
+        }
+
+    /** Queue a chunk, which is deleted when written.  Returns false
+     * if a lookup has failed, and no more chunks should be added.
+     */
+    bool add(Chunk* chunk) {
+        kyotocabinet::ScopedMutex lock(&_lock);
+
+        while (_in_flight >= _max_in_flight && !_failed) {
+            _space_cond.wait(&_lock);
+        }
+
+        if (_failed) {
+            delete chunk;
+            return false;
+        }
+
+        chunk->seq = _next_seq++;
+        _work.push_back(chunk);
+        _in_flight++;
+        _work_cond.signal();
+        return true;
+    }
+
+    /** Wait for all chunks to be written and stop the threads.
+     * Returns false if a lookup has failed.
+     */
+    bool finish() {
+        _lock.lock();
+        _closing = true;
+        _work_cond.broadcast();
+        _done_cond.broadcast();
+        _lock.unlock();
+
+        for (size_t i = 0; i < _workers.size(); i++) {
+            _workers[i]->join();
+            delete _workers[i];
+        }
+        _workers.clear();
+        _writer.join();
+
+        return !_failed;
+    }
+
+private:
+    struct Worker : public kyotocabinet::Thread {
+        void run() { pipeline->run_worker(); }
+        LookupPipeline* pipeline;
+    };
+
+    struct Writer : public kyotocabinet::Thread {
+        void run() { pipeline->run_writer(); }
+        LookupPipeline* pipeline;
+    };
+
+    void run_worker() {
+        _lock.lock();
+
+        while (true) {
+            while (_work.empty() && !_closing) {
+                _work_cond.wait(&_lock);
+            }
+
+            if (_work.empty()) {
+                break;
+            }
+
+            Chunk* chunk = _work.front();
+            _work.pop_front();
+
+            // _failed is set by the writer under the lock
+            bool failed = _failed;
+
+            _lock.unlock();
+            if (!failed) {
+                lookup_chunk(_db, *chunk);
+            }
+            _lock.lock();
+
+            _done[chunk->seq] = chunk;
+            _done_cond.signal();
+        }
+
+        _lock.unlock();
+    }
+
+    void run_writer() {
+        _lock.lock();
+
+        while (true) {
+            std::map<uint64_t, Chunk*>::iterator i =
+                _ordered ? _done.find(_next_write) : _done.begin();
+
+            if (i == _done.end()) {
+                if (_closing && _in_flight == 0) {
+                    break;
+                }
+                _done_cond.wait(&_lock);
+                continue;
+            }
+
+            Chunk* chunk = i->second;
+            _done.erase(i);
+            _next_write++;
+
+            // Once a lookup has failed, the remaining chunks are
+            // dropped just like a single-threaded lookup would stop
+            if (!_failed) {
+                _lock.unlock();
+                bool ok = write_chunk(_prog, *chunk);
+                _lock.lock();
+
+                if (!ok) {
+                    _failed = true;
+                }
+            }
+
+            delete chunk;
+            _in_flight--;
+            _space_cond.broadcast();
+        }
+
+        _lock.unlock();
+    }
+
+    const char* _prog;
+    HmSearch* _db;
+    bool _ordered;
+    size_t _max_in_flight;
+    size_t _in_flight;
+    uint64_t _next_seq;
+    uint64_t _next_write;
+    bool _closing;
+    bool _failed;
+
+    kyotocabinet::Mutex _lock;
+    kyotocabinet::CondVar _work_cond;
+    kyotocabinet::CondVar _done_cond;
+    kyotocabinet::CondVar _space_cond;
+
+    std::deque<Chunk*> _work;
+    std::map<uint64_t, Chunk*> _done;
+
+    std::vector<Worker*> _workers;
+    Writer _writer;
+};
+
+
+/** Looks up hashes on a running hm_server instead of opening the
+ * database.  Each chunk is sent as one request, and the response is
+ * in the binary output format already.
+ */
+class ServerClient
+{
+public:
+    ServerClient() : _fd(-1), _next_id(0), _hash_bits(0) {}
+
+    ~ServerClient() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool connect(const char* address, std::string* error_msg) {
+        _fd = hm_connect(address, error_msg);
+        if (_fd < 0) {
+            return false;
+        }
+
+        std::string info;
+        if (!request(HM_OP_INFO, 0, "", info, error_msg)) {
+            return false;
+        }
+
+        if (info.length() < 2 * sizeof(uint32_t)) {
+            *error_msg = "invalid server response";
+            return false;
+        }
+
+        memcpy(&_hash_bits, info.data(), sizeof(_hash_bits));
+        return true;
+    }
+
+    unsigned hash_bits() const {
+        return _hash_bits;
+    }
+
+    void lookup_chunk(Chunk& chunk) {
+        size_t hash_bytes = _hash_bits / 8;
+        std::string payload;
+        size_t i;
+
+        for (i = 0; i < chunk.inputs.size(); i++) {
+            HmSearch::hash_string query = parse_input(chunk.inputs[i], chunk.binary);
+            if (query.length() != hash_bytes) {
+                break;
+            }
+            payload.append((const char*) query.data(), query.length());
+        }
+
+        // Look up the hashes before any invalid one, so the output
+        // stops at the same place as with a local database
+        if (!payload.empty()) {
+            std::string response, error_msg;
+
+            if (!request(chunk.nearest ? HM_OP_NEAREST : HM_OP_LOOKUP, chunk.nearest,
+                         payload, response, &error_msg)) {
+                chunk.ok = false;
+                chunk.error = error_msg;
+                return;
+            }
+
+            if (!format_response(response, hash_bytes, chunk.binary, chunk.output)) {
+                chunk.ok = false;
+                chunk.error = "invalid server response";
+                return;
+            }
+        }
+
+        if (i < chunk.inputs.size()) {
+            chunk.ok = false;
+            chunk.error = ("cannot lookup hash: incorrect hash length ("
+                           + (chunk.binary ?
+                              HmSearch::format_hexhash(parse_input(chunk.inputs[i], true)) :
+                              chunk.inputs[i])
+                           + ")");
+        }
+    }
+
+private:
+    /** Send a request and wait for its response.  Server errors are
+     * returned in error_msg.
+     */
+    bool request(uint32_t op, uint32_t arg, const std::string& payload,
+                 std::string& response, std::string* error_msg) {
+        HmRequest header;
+        header.length = payload.length();
+        header.id = _next_id++;
+        header.op = op;
+        header.max_error = -1;
+        header.arg = arg;
+
+        if (!hm_write_all(_fd, &header, sizeof(header))
+            || !hm_write_all(_fd, payload.data(), payload.length())) {
+            *error_msg = "cannot send request to server";
+            return false;
+        }
+
+        HmResponse reply;
+        if (!hm_read_all(_fd, &reply, sizeof(reply))
+            || reply.id != header.id
+            || reply.length > HM_MAX_PAYLOAD) {
+            *error_msg = "no valid response from server";
+            return false;
+        }
+
+        response.resize(reply.length);
+        if (reply.length > 0 && !hm_read_all(_fd, &response[0], reply.length)) {
+            *error_msg = "no valid response from server";
+            return false;
+        }
+
+        if (reply.status != HM_STATUS_OK) {
+            *error_msg = response;
+            return false;
+        }
+
+        return true;
+    }
+
+    /** Append the matches in a binary response to the output, as
+     * text unless binary is set.  Returns false if the response is
+     * truncated.
+     */
+    static bool format_response(const std::string& response, size_t hash_bytes,
+                                bool binary, std::string& output) {
+        if (binary) {
+            output.append(response);
+            return true;
+        }
+
+        const char* p = response.data();
+        const char* end = p + response.length();
+
+        while (p < end) {
+            uint32_t count;
+            if ((size_t) (end - p) < sizeof(count)) {
+                return false;
+            }
+            memcpy(&count, p, sizeof(count));
+            p += sizeof(count);
+
+            if ((size_t) (end - p) / (hash_bytes + sizeof(uint16_t)) < count) {
+                return false;
+            }
+
+            MatchFormatter formatter(hash_bytes, false, output);
+            for (uint32_t i = 0; i < count; i++) {
+                uint16_t d;
+                memcpy(&d, p + hash_bytes, sizeof(d));
+                formatter.match((const uint8_t*) p, d);
+                p += hash_bytes + sizeof(d);
+            }
+            formatter.finish();
+        }
+
+        return true;
+    }
+
+    int _fd;
+    uint32_t _next_id;
+    uint32_t _hash_bits;
+};
+
+
+/** Prints the progress of prewarming the database on stderr.
+ */
+class PrewarmReporter : public HmSearch::PrewarmCallback
+{
+public:
+    PrewarmReporter(const char* prog) : _prog(prog) {}
+
+    void progress(const std::string& path, uint64_t done, uint64_t total) {
+        fprintf(stderr, "%s: prewarming %s: %d%% of %llu MB\n", _prog,
+                path.c_str(), total ? int(done * 100 / total) : 100,
+                (unsigned long long) (total >> 20));
+    }
+
+private:
+    const char* _prog;
+};
+
+
+static void print_stat(const char* name, uint64_t value, uint64_t lookups)
+{
+    fprintf(stderr, "%-16s %12llu %12.2f\n", name,
+            (unsigned long long) value, lookups ? (double) value / lookups : 0.0);
+}
+
+/** Print the lookup counters of the database on stderr.
+ */
+static void print_stats(HmSearch* db)
+{
+    HmSearch::LookupStats stats = db->get_lookup_stats();
+    HmSearch::CacheStats cache = db->get_cache_stats();
+
+    fprintf(stderr, "%-16s %12s %12s\n", "", "total", "per lookup");
+    print_stat("lookups", stats.lookups, stats.lookups);
+    print_stat("probes", stats.probes, stats.lookups);
+    print_stat("probe_hits", stats.probe_hits, stats.lookups);
+    print_stat("posting_bytes", stats.posting_bytes, stats.lookups);
+    print_stat("candidates", stats.candidates, stats.lookups);
+    print_stat("filtered", stats.filtered, stats.lookups);
+    print_stat("false_positives", stats.false_positives, stats.lookups);
+    print_stat("matches", stats.matches, stats.lookups);
+
+    if (cache.hits + cache.misses > 0) {
+        print_stat("cache_hits", cache.hits, stats.lookups);
+        print_stat("cache_misses", cache.misses, stats.lookups);
+    }
+}
+
+/** Lookup hashes from the command line or stdin on a server.
+ */
+static int lookup_server(const char* prog, const char* address,
+                         int num_hashes, char** hashes,
+                         bool binary, size_t nearest)
+{
+    ServerClient client;
+    std::string error_msg;
+
+    if (!client.connect(address, &error_msg)) {
+        fprintf(stderr, "%s: error connecting to %s: %s\n", prog, address, error_msg.c_str());
+        return 1;
+    }
+
+    if (num_hashes > 0) {
+        // Lookup hashes from command line
+        for (int i = 0; i < num_hashes; i++) {
+            Chunk chunk(false, nearest);
+            chunk.inputs.push_back(hashes[i]);
+            client.lookup_chunk(chunk);
+            if (!write_chunk(prog, chunk)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    size_t hash_bytes = client.hash_bits() / 8;
+    Chunk chunk(binary, nearest);
+
+    std::ios::sync_with_stdio(false);
+
+    while (read_chunk(prog, chunk, hash_bytes)) {
+        client.lookup_chunk(chunk);
+        if (!write_chunk(prog, chunk)) {
+            return 1;
+        }
+        chunk = Chunk(binary, nearest);
+    }
+
+    return 0;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-b] [-c cache_mb] [-k count] [-m] [-j threads] [-u] [-s|--stats] [--map-size mb] [--prewarm] path [hexhash...]\n", prog);
+    fprintf(stderr, "       %s [-b] [-k count] --server address [hexhash...]\n", prog);
+}
+
+static const struct option long_options[] = {
+    { "stats", no_argument, NULL, 's' },
+    { "server", required_argument, NULL, 'S' },
+    { "map-size", required_argument, NULL, 'M' },
+    { "prewarm", no_argument, NULL, 'W' },
+    { NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s path [hexhash...]\n", argv[0]);
+    HmSearch::OpenMode mode = HmSearch::READONLY;
+    int threads = 0;
+    bool ordered = true;
+    bool binary = false;
+    size_t nearest = 0;
+    size_t cache_mb = 0;
+    bool show_stats = false;
+    const char* server = NULL;
+    HmSearch::OpenOptions options;
+    PrewarmReporter reporter(argv[0]);
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "bc:k:mj:us", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = true;
+            break;
+
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'k':
+            nearest = strtoul(optarg, NULL, 10);
+            if (nearest < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'm':
+            mode = HmSearch::MEMORY;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'u':
+            ordered = false;
+            break;
+
+        case 's':
+            show_stats = true;
+            break;
+
+        case 'S':
+            server = optarg;
+            break;
+
+        case 'M':
+            options.map_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+
+        case 'W':
+            options.prewarm = HmSearch::PREWARM_WAIT;
+            options.callback = &reporter;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (server) {
+        // The database options are the server's business
+        if (mode != HmSearch::READONLY || cache_mb || threads || !ordered || show_stats
+            || options.map_size || options.prewarm != HmSearch::PREWARM_NONE) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        return lookup_server(argv[0], server, argc - optind, argv + optind,
+                             binary, nearest);
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *path = argv[1];
+    const char *path = argv[optind];
     std::string error_msg;
     
-    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READONLY, &error_msg));
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, mode, options, &error_msg));
     if (!db.get()) {
         fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
         return 1;
     }
 
-    if (argc > 2) {
+    db->set_result_cache(cache_mb << 20);
+
+    if (optind + 1 < argc) {
         // Lookup hashes from command line
-        for (int i = 2; i < argc; i++) {
-            const char *hexhash = argv[i];
+        for (int i = optind + 1; i < argc; i++) {
+            std::string output, error;
+            bool ok = lookup(db.get(), argv[i], false, nearest, output, error);
 
-            HmSearch::LookupResultList matches;
-            if (!db->lookup(HmSearch::parse_hexhash(hexhash), matches, -1, &error_msg)) {
-                fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
-                        argv[0], error_msg.c_str(), hexhash);
+            std::cout << output;
+            if (!ok) {
+                fprintf(stderr, "%s: %s\n", argv[0], error.c_str());
                 return 1;
             }
-
-            for (HmSearch::LookupResultList::const_iterator i = matches.begin();
-                 i != matches.end();
-                 ++i) {
-                std::cout << HmSearch::format_hexhash(i->hash) << " " << i->distance << std::endl;
-            }
         }
     }
     else {
-        // Read hashes from stdin
-        std::string hexhash;
-        while (std::cin >> hexhash) {
-            HmSearch::LookupResultList matches;
-            if (!db->lookup(HmSearch::parse_hexhash(hexhash), matches, -1, &error_msg)) {
-                fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
-                        argv[0], error_msg.c_str(), hexhash.c_str());
+        size_t hash_bytes = db->hash_bits() / 8;
+
+        std::ios::sync_with_stdio(false);
+
+        if (threads > 0) {
+            // Read hashes from stdin, looking up batches on worker threads
+            LookupPipeline pipeline(argv[0], db.get(), threads, ordered);
+
+            while (true) {
+                std::auto_ptr<Chunk> chunk(new Chunk(binary, nearest));
+
+                if (!read_chunk(argv[0], *chunk, hash_bytes)
+                    || !pipeline.add(chunk.release())) {
+                    break;
+                }
+            }
+
+            if (!pipeline.finish()) {
                 return 1;
             }
+        }
+        else {
+            // Read hashes from stdin, looking them up in batches
+            Chunk chunk(binary, nearest);
 
-            for (HmSearch::LookupResultList::const_iterator i = matches.begin();
-                 i != matches.end();
-                 ++i) {
-                std::cout << HmSearch::format_hexhash(i->hash) << " " << i->distance << std::endl;
+            while (read_chunk(argv[0], chunk, hash_bytes)) {
+                lookup_chunk(db.get(), chunk);
+                if (!write_chunk(argv[0], chunk)) {
+                    return 1;
+                }
+                chunk = Chunk(binary, nearest);
             }
         }
     }
 
+    if (show_stats) {
+        print_stats(db.get());
+    }
+
     return 0;
 }
 
@@ -0,0 +1,196 @@
+/* HmSearch hash library - hm_server protocol
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __HM_PROTOCOL_H_INCLUDED__
+#define __HM_PROTOCOL_H_INCLUDED__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+/* The protocol between hm_server and its clients.
+ *
+ * The server only listens on a Unix domain socket or on loopback
+ * TCP, so all integers are in native byte order.
+ *
+ * Each request is a HmRequest header followed by length bytes of
+ * payload, and is answered by a HmResponse header followed by length
+ * bytes of payload, carrying the same id.  Clients may send several
+ * requests without waiting, and the responses may come back in any
+ * order.
+ *
+ * HM_OP_INFO:    No payload.  The response holds hash_bits and
+ *                max_error of the database as two uint32_t.
+ *
+ * HM_OP_LOOKUP:  The payload is query hashes back-to-back.  The
+ *                response holds, for each query, the number of matches
+ *                as a uint32_t followed by each matching hash and its
+ *                distance as a uint16_t.  This is the same as the
+ *                output of hm_lookup -b.
+ *
+ * HM_OP_NEAREST: As HM_OP_LOOKUP, but only the arg closest matches of
+ *                each query are returned.
+ *
+ * HM_OP_INSERT:  The payload is hashes to insert back-to-back.  The
+ *                response is empty.
+ *
+ * max_error reduces the maximum distance of lookups if it is >= 0.
+ * If a request fails, the response status is HM_STATUS_ERROR and its
+ * payload is an error message.
+ */
+
+struct HmRequest {
+    uint32_t length;
+    uint32_t id;
+    uint32_t op;
+    int32_t max_error;
+    uint32_t arg;
+};
+
+struct HmResponse {
+    uint32_t length;
+    uint32_t id;
+    uint32_t status;
+};
+
+#define HM_OP_INFO 1
+#define HM_OP_LOOKUP 2
+#define HM_OP_NEAREST 3
+#define HM_OP_INSERT 4
+
+#define HM_STATUS_OK 0
+#define HM_STATUS_ERROR 1
+
+// Larger requests are rejected by closing the connection
+#define HM_MAX_PAYLOAD (64 << 20)
+
+
+/** Parse a server address: tcp:PORT for loopback TCP, anything else
+ * is the path of a Unix domain socket.  Returns false if the address
+ * is invalid.
+ */
+static inline bool hm_parse_address(const char* address,
+                                    struct sockaddr_storage* addr,
+                                    socklen_t* addr_len)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (strncmp(address, "tcp:", 4) == 0) {
+        char* end;
+        unsigned long port = strtoul(address + 4, &end, 10);
+        if (end == address + 4 || *end || port == 0 || port > 65535) {
+            return false;
+        }
+
+        struct sockaddr_in* in = (struct sockaddr_in*) addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *addr_len = sizeof(*in);
+        return true;
+    }
+
+    struct sockaddr_un* un = (struct sockaddr_un*) addr;
+    if (!*address || strlen(address) >= sizeof(un->sun_path)) {
+        return false;
+    }
+
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    *addr_len = sizeof(*un);
+    return true;
+}
+
+
+/** Connect to a server.  Returns the socket, or -1 on errors. */
+static inline int hm_connect(const char* address, std::string* error_msg)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    if (!hm_parse_address(address, &addr, &addr_len)) {
+        *error_msg = "invalid server address";
+        return -1;
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*) &addr, addr_len) != 0) {
+        *error_msg = strerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    if (addr.ss_family == AF_INET) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    return fd;
+}
+
+
+/** Write all of a buffer to a blocking socket. */
+static inline bool hm_write_all(int fd, const void* data, size_t length)
+{
+    const char* p = (const char*) data;
+
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+
+/** Read exactly length bytes from a blocking socket. */
+static inline bool hm_read_all(int fd, void* data, size_t length)
+{
+    char* p = (char*) data;
+
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __HM_PROTOCOL_H_INCLUDED__
@@ -0,0 +1,1019 @@
+/* HmSearch hash library - lookup server
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <kcthread.h>
+
+#include "hmsearch.h"
+#include "hm_protocol.h"
+
+// Most query or insert hashes coalesced into one batch
+#define MAX_BATCH_HASHES 1024
+
+// Events handled per epoll_wait() call
+#define MAX_EVENTS 64
+
+// A connection is not read from while it has this much unsent output,
+// or this many requests waiting for a response, so clients that
+// don't read their responses can't make the server buffer them
+// without limit
+#define MAX_OUTPUT_BYTES (16 << 20)
+#define MAX_PENDING_REQUESTS 1024
+
+// epoll data for the server's own file descriptors.  Connections are
+// numbered from FIRST_CONNECTION.
+#define LISTEN_ID 0
+#define WAKE_ID 1
+#define SIGNAL_ID 2
+#define TIMER_ID 3
+#define FIRST_CONNECTION 16
+
+
+/** A request read from a connection, and later its response.
+ */
+struct Request {
+    uint64_t connection;
+    HmRequest header;
+    std::string payload;
+
+    uint32_t status;
+    std::string response;
+};
+
+
+/** Requests of the same kind collected within the batch window, to
+ * be handled together by one worker task.
+ */
+struct Batch {
+    Batch() : op(0), max_error(-1), hashes(0) {}
+
+    uint32_t op;
+    int32_t max_error;
+    size_t hashes;
+    std::vector<Request*> requests;
+};
+
+
+/** A client connection.  Requests are parsed from the input buffer,
+ * and responses queued in the output buffer until the socket is
+ * writable.
+ */
+struct Connection {
+    Connection(int f)
+        : fd(f), output_pos(0), pending(0), eof(false), events(EPOLLIN)
+        {}
+
+    bool backlogged() const {
+        return (output.length() - output_pos > MAX_OUTPUT_BYTES
+                || pending >= MAX_PENDING_REQUESTS);
+    }
+
+    int fd;
+    std::string input;
+    std::string output;
+    size_t output_pos;
+
+    // Requests read but not yet responded to
+    size_t pending;
+
+    // Set when the client has shut down its end.  The connection is
+    // closed once all its responses have been written.
+    bool eof;
+
+    // The events the connection is watched for
+    uint32_t events;
+};
+
+
+class Server;
+
+/** Handles a batch on the worker pool and hands the responses back to
+ * the event loop.
+ */
+struct BatchTask : public kyotocabinet::TaskQueue::Task {
+    BatchTask(Server* s) : server(s) {}
+    Server* server;
+    Batch batch;
+};
+
+
+class Server
+{
+public:
+    Server(const char* prog, HmSearch* db, bool writable, long window_us)
+        : _prog(prog)
+        , _db(db)
+        , _hash_bytes(db->hash_bits() / 8)
+        , _writable(writable)
+        , _window_us(window_us)
+        , _listen_fd(-1)
+        , _epoll_fd(-1)
+        , _wake_fd(-1)
+        , _signal_fd(-1)
+        , _timer_fd(-1)
+        , _timer_armed(false)
+        , _next_connection(FIRST_CONNECTION)
+        {
+            _queue.server = this;
+        }
+
+    ~Server();
+
+    bool listen(const char* address, std::string* error_msg);
+    bool run(int threads, std::string* error_msg);
+
+private:
+    class WorkQueue : public kyotocabinet::TaskQueue {
+    public:
+        void do_task(Task* task) {
+            BatchTask* bt = static_cast<BatchTask*>(task);
+            server->handle_batch(bt->batch);
+            server->complete(bt->batch.requests);
+            delete bt;
+        }
+        Server* server;
+    };
+
+    bool add_fd(int fd, uint64_t id, std::string* error_msg);
+    void accept_connections();
+    void read_connection(uint64_t id);
+    void write_connection(uint64_t id);
+    void close_connection(uint64_t id);
+    void update_events(uint64_t id, Connection* conn);
+    bool parse_requests(uint64_t id, Connection* conn);
+    void add_request(Request* request);
+    void respond(Request* request);
+    void flush_batch(Batch& batch);
+    void flush_batches();
+    void arm_timer();
+    void deliver_responses();
+
+    void handle_batch(Batch& batch);
+    void lookup_batch(Batch& batch);
+    void insert_batch(Batch& batch);
+    void complete(std::vector<Request*>& requests);
+
+    const char* _prog;
+    HmSearch* _db;
+    size_t _hash_bytes;
+    bool _writable;
+    long _window_us;
+
+    std::string _socket_path;
+    int _listen_fd;
+    int _epoll_fd;
+    int _wake_fd;
+    int _signal_fd;
+    int _timer_fd;
+    bool _timer_armed;
+
+    uint64_t _next_connection;
+    std::map<uint64_t, Connection*> _connections;
+
+    Batch _lookups;
+    Batch _inserts;
+
+    WorkQueue _queue;
+
+    // Requests handled by the workers, waiting to be delivered
+    kyotocabinet::Mutex _done_lock;
+    std::vector<Request*> _done;
+};
+
+
+Server::~Server()
+{
+    for (std::map<uint64_t, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i) {
+        ::close(i->second->fd);
+        delete i->second;
+    }
+
+    int fds[] = { _listen_fd, _epoll_fd, _wake_fd, _signal_fd, _timer_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            ::close(fds[i]);
+        }
+    }
+
+    if (!_socket_path.empty()) {
+        unlink(_socket_path.c_str());
+    }
+}
+
+
+bool Server::listen(const char* address, std::string* error_msg)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    if (!hm_parse_address(address, &addr, &addr_len)) {
+        *error_msg = "invalid address";
+        return false;
+    }
+
+    _listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listen_fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        // Replace a socket left behind by a previous server
+        struct stat st;
+        if (lstat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(address);
+        }
+    }
+    else {
+        int one = 1;
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+
+    if (bind(_listen_fd, (struct sockaddr*) &addr, addr_len) != 0
+        || ::listen(_listen_fd, SOMAXCONN) != 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        _socket_path = address;
+    }
+
+    return true;
+}
+
+
+bool Server::add_fd(int fd, uint64_t id, std::string* error_msg)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = id;
+
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+
+/** The signals that stop the server cleanly, so the database is
+ * closed.  They are blocked in all threads and read from a signalfd.
+ */
+static void stop_signals(sigset_t* signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+}
+
+
+bool Server::run(int threads, std::string* error_msg)
+{
+    sigset_t signals;
+    stop_signals(&signals);
+
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (_epoll_fd < 0 || _wake_fd < 0 || _signal_fd < 0 || _timer_fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    if (!add_fd(_listen_fd, LISTEN_ID, error_msg)
+        || !add_fd(_wake_fd, WAKE_ID, error_msg)
+        || !add_fd(_signal_fd, SIGNAL_ID, error_msg)
+        || !add_fd(_timer_fd, TIMER_ID, error_msg)) {
+        return false;
+    }
+
+    _queue.start(threads);
+
+    bool running = true;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running) {
+        int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *error_msg = strerror(errno);
+            running = false;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+
+            switch (id) {
+            case LISTEN_ID:
+                accept_connections();
+                break;
+
+            case WAKE_ID:
+                deliver_responses();
+                break;
+
+            case SIGNAL_ID:
+                running = false;
+                break;
+
+            case TIMER_ID: {
+                uint64_t expirations;
+                if (read(_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    _timer_armed = false;
+                    flush_batches();
+                }
+                break;
+            }
+
+            default:
+                // The client is gone and can't receive responses
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    close_connection(id);
+                    break;
+                }
+                if (events[i].events & EPOLLIN) {
+                    read_connection(id);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    write_connection(id);
+                }
+                break;
+            }
+        }
+
+        // Without a window, only requests read in the same round are
+        // coalesced
+        if (_window_us == 0) {
+            flush_batches();
+        }
+    }
+
+    // Let the workers finish what has been queued so far, and send
+    // what responses can still be sent
+    flush_batches();
+    _queue.finish();
+    deliver_responses();
+
+    return error_msg->empty();
+}
+
+
+void Server::accept_connections()
+{
+    while (true) {
+        int fd = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "%s: cannot accept connection: %s\n", _prog, strerror(errno));
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        uint64_t id = _next_connection++;
+        std::string error;
+
+        if (!add_fd(fd, id, &error)) {
+            fprintf(stderr, "%s: cannot add connection: %s\n", _prog, error.c_str());
+            ::close(fd);
+            continue;
+        }
+
+        _connections[id] = new Connection(fd);
+    }
+}
+
+
+void Server::read_connection(uint64_t id)
+{
+    std::map<uint64_t, Connection*>::iterator i = _connections.find(id);
+    if (i == _connections.end()) {
+        return;
+    }
+
+    Connection* conn = i->second;
+    char buf[65536];
+
+    while (!conn->eof && !conn->backlogged()) {
+        ssize_t n = read(conn->fd, buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        if (n < 0) {
+            // Any responses still being worked on are dropped when
+            // they complete
+            close_connection(id);
+            return;
+        }
+
+        if (n == 0) {
+            // The client may still be waiting for the responses to
+            // what it sent before shutting down its end
+            conn->eof = true;
+        }
+        else {
+            conn->input.append(buf, n);
+        }
+
+        if (!parse_requests(id, conn)) {
+            close_connection(id);
+            return;
+        }
+    }
+
+    // Send any responses that could be given right away, and close
+    // the connection if it is done
+    write_connection(id);
+}
+
+
+/** Parse all complete requests in the input buffer.  Returns false
+ * if the client broke the protocol.
+ */
+bool Server::parse_requests(uint64_t id, Connection* conn)
+{
+    size_t pos = 0;
+
+    while (conn->input.length() - pos >= sizeof(HmRequest)) {
+        HmRequest header;
+        memcpy(&header, conn->input.data() + pos, sizeof(header));
+
+        if (header.length > HM_MAX_PAYLOAD) {
+            return false;
+        }
+
+        if (conn->input.length() - pos < sizeof(header) + header.length) {
+            break;
+        }
+
+        Request* request = new Request;
+        conn->pending++;
+        request->connection = id;
+        request->header = header;
+        request->payload.assign(conn->input, pos + sizeof(header), header.length);
+        request->status = HM_STATUS_OK;
+
+        pos += sizeof(header) + header.length;
+        add_request(request);
+    }
+
+    conn->input.erase(0, pos);
+    return true;
+}
+
+
+void Server::add_request(Request* request)
+{
+    const HmRequest& header = request->header;
+
+    if (header.op == HM_OP_INFO) {
+        uint32_t info[2] = { _db->hash_bits(), _db->max_error() };
+        request->response.assign((const char*) info, sizeof(info));
+        respond(request);
+        return;
+    }
+
+    if (header.op != HM_OP_LOOKUP && header.op != HM_OP_NEAREST
+        && header.op != HM_OP_INSERT) {
+        request->status = HM_STATUS_ERROR;
+        request->response = "unknown request";
+        respond(request);
+        return;
+    }
+
+    if (request->payload.length() % _hash_bytes != 0) {
+        request->status = HM_STATUS_ERROR;
+        request->response = "incorrect hash length";
+        respond(request);
+        return;
+    }
+
+    if (header.op == HM_OP_INSERT && !_writable) {
+        request->status = HM_STATUS_ERROR;
+        request->response = "database is read-only";
+        respond(request);
+        return;
+    }
+
+    size_t hashes = request->payload.length() / _hash_bytes;
+
+    if (header.op == HM_OP_NEAREST) {
+        // Nearest-match lookups can't share the work of a batch
+        BatchTask* task = new BatchTask(this);
+        task->batch.op = header.op;
+        task->batch.max_error = header.max_error;
+        task->batch.hashes = hashes;
+        task->batch.requests.push_back(request);
+        _queue.add_task(task);
+        return;
+    }
+
+    Batch& batch = header.op == HM_OP_INSERT ? _inserts : _lookups;
+
+    // A batch is looked up with a single max error
+    if (!batch.requests.empty()
+        && (batch.max_error != header.max_error
+            || batch.hashes + hashes > MAX_BATCH_HASHES)) {
+        flush_batch(batch);
+    }
+
+    batch.op = header.op;
+    batch.max_error = header.max_error;
+    batch.hashes += hashes;
+    batch.requests.push_back(request);
+
+    if (batch.hashes >= MAX_BATCH_HASHES) {
+        flush_batch(batch);
+    }
+    else {
+        arm_timer();
+    }
+}
+
+
+void Server::flush_batch(Batch& batch)
+{
+    if (batch.requests.empty()) {
+        return;
+    }
+
+    BatchTask* task = new BatchTask(this);
+    task->batch = batch;
+    _queue.add_task(task);
+
+    batch = Batch();
+}
+
+
+void Server::flush_batches()
+{
+    flush_batch(_lookups);
+    flush_batch(_inserts);
+}
+
+
+/** Start the batch window, unless it is already running.
+ */
+void Server::arm_timer()
+{
+    if (_window_us == 0 || _timer_armed) {
+        return;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = _window_us / 1000000;
+    spec.it_value.tv_nsec = (_window_us % 1000000) * 1000;
+
+    if (timerfd_settime(_timer_fd, 0, &spec, NULL) == 0) {
+        _timer_armed = true;
+    }
+    else {
+        flush_batches();
+    }
+}
+
+
+/** Queue the response to a request on its connection, if it is still
+ * open, and delete the request.
+ */
+void Server::respond(Request* request)
+{
+    std::map<uint64_t, Connection*>::iterator i = _connections.find(request->connection);
+
+    if (i != _connections.end()) {
+        HmResponse header;
+        header.length = request->response.length();
+        header.id = request->header.id;
+        header.status = request->status;
+
+        Connection* conn = i->second;
+        conn->output.append((const char*) &header, sizeof(header));
+        conn->output.append(request->response);
+        conn->pending--;
+    }
+
+    delete request;
+}
+
+
+void Server::deliver_responses()
+{
+    // Reset the wakeup counter.  The done list is checked even if
+    // there was no wakeup, so this can also run after the workers
+    // have stopped.
+    uint64_t count;
+    if (read(_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "%s: cannot read wakeup: %s\n", _prog, strerror(errno));
+    }
+
+    std::vector<Request*> done;
+    {
+        kyotocabinet::ScopedMutex lock(&_done_lock);
+        done.swap(_done);
+    }
+
+    std::vector<uint64_t> ids;
+    for (size_t i = 0; i < done.size(); i++) {
+        ids.push_back(done[i]->connection);
+        respond(done[i]);
+    }
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        write_connection(ids[i]);
+    }
+}
+
+
+void Server::write_connection(uint64_t id)
+{
+    std::map<uint64_t, Connection*>::iterator i = _connections.find(id);
+    if (i == _connections.end()) {
+        return;
+    }
+
+    Connection* conn = i->second;
+
+    while (conn->output_pos < conn->output.length()) {
+        ssize_t n = write(conn->fd, conn->output.data() + conn->output_pos,
+                          conn->output.length() - conn->output_pos);
+        if (n > 0) {
+            conn->output_pos += n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        close_connection(id);
+        return;
+    }
+
+    if (conn->output_pos == conn->output.length()) {
+        conn->output.clear();
+        conn->output_pos = 0;
+
+        if (conn->eof && conn->pending == 0) {
+            close_connection(id);
+            return;
+        }
+    }
+
+    update_events(id, conn);
+}
+
+
+/** Watch the socket for input only while the client may send more
+ * and isn't backlogged, and for writability only while there is
+ * output that didn't fit.
+ */
+void Server::update_events(uint64_t id, Connection* conn)
+{
+    uint32_t events = 0;
+
+    if (!conn->eof && !conn->backlogged()) {
+        events |= EPOLLIN;
+    }
+
+    if (conn->output_pos < conn->output.length()) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.u64 = id;
+
+        epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+
+void Server::close_connection(uint64_t id)
+{
+    std::map<uint64_t, Connection*>::iterator i = _connections.find(id);
+    if (i == _connections.end()) {
+        return;
+    }
+
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, i->second->fd, NULL);
+    ::close(i->second->fd);
+    delete i->second;
+    _connections.erase(i);
+}
+
+
+/** Append the matches of one query to a response, in the format of
+ * hm_lookup -b.
+ */
+static void format_matches(const HmSearch::LookupResultList& matches,
+                           std::string& response)
+{
+    uint32_t count = matches.size();
+    response.append((const char*) &count, sizeof(count));
+
+    for (HmSearch::LookupResultList::const_iterator i = matches.begin();
+         i != matches.end();
+         ++i) {
+        uint16_t d = i->distance;
+        response.append((const char*) i->hash.data(), i->hash.length());
+        response.append((const char*) &d, sizeof(d));
+    }
+}
+
+
+/** Split the payload of a request into hashes.
+ */
+static void get_hashes(const Request* request, size_t hash_bytes,
+                       std::vector<HmSearch::hash_string>& hashes)
+{
+    const uint8_t* p = (const uint8_t*) request->payload.data();
+
+    for (size_t i = 0; i < request->payload.length(); i += hash_bytes) {
+        hashes.push_back(HmSearch::hash_string(p + i, hash_bytes));
+    }
+}
+
+
+void Server::handle_batch(Batch& batch)
+{
+    if (batch.op == HM_OP_INSERT) {
+        insert_batch(batch);
+        return;
+    }
+
+    lookup_batch(batch);
+}
+
+
+void Server::lookup_batch(Batch& batch)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::vector<HmSearch::LookupResultList> results;
+
+    for (size_t i = 0; i < batch.requests.size(); i++) {
+        get_hashes(batch.requests[i], _hash_bytes, queries);
+    }
+
+    // Nearest-match lookups are done one hash at a time, as are
+    // batches that failed, so the error is reported to the right
+    // requests only
+    if (batch.op == HM_OP_LOOKUP
+        && _db->lookup_batch(queries, results, batch.max_error)) {
+        size_t q = 0;
+
+        for (size_t i = 0; i < batch.requests.size(); i++) {
+            Request* request = batch.requests[i];
+            size_t end = q + request->payload.length() / _hash_bytes;
+
+            for (; q < end; q++) {
+                format_matches(results[q], request->response);
+            }
+        }
+        return;
+    }
+
+    size_t q = 0;
+
+    for (size_t i = 0; i < batch.requests.size(); i++) {
+        Request* request = batch.requests[i];
+        size_t end = q + request->payload.length() / _hash_bytes;
+
+        for (; q < end; q++) {
+            HmSearch::LookupResultList matches;
+            std::string error_msg;
+            bool ok = (batch.op == HM_OP_NEAREST ?
+                       _db->lookup_nearest(queries[q], request->header.arg, matches,
+                                           batch.max_error, &error_msg) :
+                       _db->lookup(queries[q], matches, batch.max_error, &error_msg));
+
+            if (!ok) {
+                request->status = HM_STATUS_ERROR;
+                request->response = "cannot lookup hash: " + error_msg;
+                q = end;
+                break;
+            }
+
+            format_matches(matches, request->response);
+        }
+    }
+}
+
+
+void Server::insert_batch(Batch& batch)
+{
+    std::vector<HmSearch::hash_string> hashes;
+
+    for (size_t i = 0; i < batch.requests.size(); i++) {
+        get_hashes(batch.requests[i], _hash_bytes, hashes);
+    }
+
+    std::string error_msg;
+    if (_db->insert_batch(hashes, &error_msg)) {
+        return;
+    }
+
+    for (size_t i = 0; i < batch.requests.size(); i++) {
+        batch.requests[i]->status = HM_STATUS_ERROR;
+        batch.requests[i]->response = "cannot insert hashes: " + error_msg;
+    }
+}
+
+
+/** Hand the handled requests of a batch back to the event loop.
+ */
+void Server::complete(std::vector<Request*>& requests)
+{
+    {
+        kyotocabinet::ScopedMutex lock(&_done_lock);
+        _done.insert(_done.end(), requests.begin(), requests.end());
+    }
+
+    uint64_t one = 1;
+    if (write(_wake_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "%s: cannot wake event loop: %s\n", _prog, strerror(errno));
+    }
+}
+
+
+/** Prints the progress of prewarming the database on stderr, while
+ * the server is already answering requests.
+ */
+class PrewarmReporter : public HmSearch::PrewarmCallback
+{
+public:
+    PrewarmReporter(const char* prog) : _prog(prog) {}
+
+    void progress(const std::string& path, uint64_t done, uint64_t total) {
+        fprintf(stderr, "%s: prewarming %s: %d%% of %llu MB\n", _prog,
+                path.c_str(), total ? int(done * 100 / total) : 100,
+                (unsigned long long) (total >> 20));
+    }
+
+private:
+    const char* _prog;
+};
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-w] [-m] [-j threads] [-d window_us] [-c cache_mb] [-M map_mb] [-p] path address\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    HmSearch::OpenMode mode = HmSearch::READONLY;
+    int threads = 4;
+    long window_us = 200;
+    size_t cache_mb = 0;
+    HmSearch::OpenOptions options;
+    PrewarmReporter reporter(argv[0]);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "wmj:d:c:M:p")) != -1) {
+        switch (opt) {
+        case 'w':
+            mode = HmSearch::READWRITE;
+            break;
+
+        case 'm':
+            mode = HmSearch::MEMORY;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'd':
+            window_us = atol(optarg);
+            if (window_us < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'M':
+            options.map_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+
+        case 'p':
+            options.prewarm = HmSearch::PREWARM_BACKGROUND;
+            options.callback = &reporter;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    const char *address = argv[optind + 1];
+    std::string error_msg;
+
+    // Block the stop signals before any threads are started, since
+    // sharded databases start theirs when opened
+    sigset_t signals;
+    stop_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, mode, options, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    db->set_result_cache(cache_mb << 20);
+
+    {
+        Server server(argv[0], db.get(), mode == HmSearch::READWRITE, window_us);
+
+        if (!server.listen(address, &error_msg)) {
+            fprintf(stderr, "%s: cannot listen on %s: %s\n", argv[0], address, error_msg.c_str());
+            return 1;
+        }
+
+        if (!server.run(threads, &error_msg)) {
+            fprintf(stderr, "%s: %s\n", argv[0], error_msg.c_str());
+            return 1;
+        }
+    }
+
+    if (!db->close(&error_msg)) {
+        fprintf(stderr, "%s: error closing %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -8,105 +8,130 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <memory>
 #include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <kcdbext.h>
 
-#include "hmsearch.h"
+#include "hmsearch_impl.h"
 
-/** The actual implementation of the HmSearch database.
- *
- * A difference between this implementation and the HmSearch algorithm
- * in the paper is that only exact-matches are stored in the database,
- * not the 1-matches.  The 1-var partitions are instead generated
- * during lookup.  This drastically reduces database size, which with
- * Kyoto Cabinet speeds up insertion and probably lookups too.
- *
- * The database contains some setting records controlling the
- * operation:
- *
- * _hb: hash bits
- * _me: max errors
- *
- * These can't be changed once the database has been initialised.
+// Posting-list buffers holding more than this after a lookup are
+// freed instead of being kept for the next lookup
+#define MAX_POOLED_BUFFER_BYTES (16 << 20)
+
+// Approximate size of the posting list chunks in new databases
+#define CHUNK_BYTES 4096
+
+// Limit on the number of shards of a sharded database
+#define MAX_SHARDS 256
+
+// Prewarming reads database files in blocks of this size, and reports
+// progress about this often
+#define PREWARM_BLOCK_BYTES (1 << 20)
+#define PREWARM_REPORT_BYTES (64 << 20)
+
+/** Bulk database builder using an external sort.
  *
- * Each partition is stored as a key on the following format:
- *  Byte 0: 'P'
- *  Byte 1: Partition number (thus limiting to max error 518)
- *  Bytes 2-N: Partition bits.
+ * Every (partition key, hash) pair is collected as a fixed-size
+ * record.  When the records fill the memory limit they are sorted
+ * and written to a spill file next to the database.  finish() merges
+ * the sorted runs twice: first to count the distinct partition keys
+ * so the database can be tuned for the exact key count, then to
+ * write each partition record in one go.
  */
-class HmSearchImpl : public HmSearch
+class HmSearchBuilder : public HmSearch::Builder, private PartitionLayout
 {
 public:
-    HmSearchImpl(kyotocabinet::PolyDB* db, int hash_bits, int max_error)
-        : _db(db)
-        , _hash_bits(hash_bits)
-        , _max_error(max_error)
-        , _hash_bytes((hash_bits + 7) / 8)
-        , _partitions((max_error + 3) / 2)
-        , _partition_bits(ceil((double)hash_bits / _partitions))
-        , _partition_bytes((_partition_bits + 7) / 8 + 1)
+    HmSearchBuilder(const std::string& path, int hash_bits, int max_error,
+                    size_t memory_limit)
+        : PartitionLayout(hash_bits, max_error)
+        , _path(path)
+        , _record_bytes(key_length() + _hash_bytes)
+        , _max_records(std::max(memory_limit / (_record_bytes + sizeof(size_t)),
+                                size_t(1)))
+        , _finished(false)
         { }
 
-    ~HmSearchImpl() {
-        close();
-    }
-    
-    bool insert(const hash_string& hash,
-                std::string* error_msg = NULL);
-    
-    bool lookup(const hash_string& query,
-                LookupResultList& result,
-                int max_error = -1,
-                std::string* error_msg = NULL);
+    ~HmSearchBuilder();
 
-    bool close(std::string* error_msg = NULL);
+    bool add(const HmSearch::hash_string& hash,
+             std::string* error_msg = NULL);
 
-    void dump();
+    bool finish(std::string* error_msg = NULL);
 
 private:
-    struct Candidate {
-        Candidate() : matches(0), first_match(0), second_match(0) {}
-        int matches;
-        int first_match;
-        int second_match;
+    /** Orders records in the buffer by their bytes.
+     */
+    struct RecordLess {
+        RecordLess(const uint8_t* r, int b) : records(r), bytes(b) {}
+
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(records + a * bytes, records + b * bytes, bytes) < 0;
+        }
+
+        const uint8_t* records;
+        int bytes;
     };
 
-    typedef std::map<hash_string, Candidate> CandidateMap;
-    
-    void get_candidates(const hash_string& query, CandidateMap& candidates);
-    void add_hash_candidates(CandidateMap& candidates, int match,
-                             const uint8_t* hashes, size_t length);
-    bool valid_candidate(const Candidate& candidate);
-    int hamming_distance(const hash_string& query, const hash_string& hash);
-    
-    int get_partition_key(const hash_string& hash, int partition, uint8_t *key);
+    /** A sorted run being merged: either a spill file or, if there
+     * are no spill files, the sorted buffer.
+     */
+    struct Run {
+        FILE* file;
+        size_t pos;
+        std::vector<uint8_t> record;
+    };
+
+    /** Orders runs in a priority queue so the smallest record is on top.
+     */
+    struct RunGreater {
+        RunGreater(const std::vector<Run>* r, int b) : runs(r), bytes(b) {}
+
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(&(*runs)[a].record[0], &(*runs)[b].record[0], bytes) > 0;
+        }
+
+        const std::vector<Run>* runs;
+        int bytes;
+    };
+
+    bool buffer_full() const {
+        return _order.size() >= _max_records;
+    }
+
+    void sort_buffer();
+    bool spill_buffer(std::string* error_msg);
+    bool merge_runs(kyotocabinet::HashDB* db, uint64_t* keys,
+                    std::string* error_msg);
+    bool next_record(Run& run, std::string* error_msg);
 
-    kyotocabinet::PolyDB* _db;
-    int _hash_bits;
-    int _max_error;
-    int _hash_bytes;
-    int _partitions;
-    int _partition_bits;
-    int _partition_bytes;
+    std::string _path;
+    int _record_bytes;
+    size_t _max_records;
+    bool _finished;
 
-    static int one_bits[256];
+    std::vector<uint8_t> _buffer;
+    std::vector<size_t> _order;
+    std::vector<FILE*> _spills;
 };
 
 
-bool HmSearch::init(const std::string& path,
-                    unsigned hash_bits, unsigned max_error,
-                    uint64_t num_hashes,
+bool check_settings(unsigned hash_bits, unsigned max_error,
                     std::string* error_msg)
 {
-    std::string dummy;
-    if (!error_msg) {
-        error_msg = &dummy;
-    }
-    *error_msg = "";
-
     if (hash_bits == 0 || (hash_bits & 7)) {
         *error_msg = "invalid hash_bits value";
         return false;
@@ -117,23 +142,14 @@ bool HmSearch::init(const std::string& path,
         return false;
     }
 
-    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
-    if (!db.get()) {
-        return false;
-    }
-
-    int partitions = (max_error + 3) / 2;
-    int partition_bits = ceil((double)hash_bits / partitions);
-
-    uint64_t hashes_per_partition = std::max(uint64_t(1), num_hashes / (uint64_t(1) << partition_bits));
+    return true;
+}
 
-    // TODO: handle >1 hashes_per_partition by setting suitable
-    // alignment to allow efficient append and perhaps even having a
-    // metablock structure where the partition record just contains
-    // references to blocks that actually holds the hashes.
-    
-    uint64_t keys = (num_hashes / hashes_per_partition) * partitions;
 
+/** Tune a new database for holding the given number of partition keys.
+ */
+static void tune_database(kyotocabinet::HashDB* db, uint64_t keys)
+{
     // Limit to 0.5 GB index size, might make this configurable too
     int bucket_size = 6;
     int64_t buckets = std::max(int64_t(keys) / bucket_size, int64_t(512) << 20 / bucket_size);  
@@ -142,7 +158,19 @@ bool HmSearch::init(const std::string& path,
 
     // Smaller database and quicker inserts, no big effect on lookups
     db->tune_options(kyotocabinet::HashDB::TLINEAR);
-    
+}
+
+
+/** Open a new database file for writing, checking that it is empty,
+ * and store the settings records in it.
+ */
+static bool create_database(kyotocabinet::HashDB* db,
+                            const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            unsigned id_bits, const ChunkFormat& chunks,
+                            const std::vector<uint16_t>& permutation,
+                            std::string* error_msg)
+{
     if (!db->open(path, kyotocabinet::BasicDB::OWRITER | kyotocabinet::BasicDB::OCREATE)) {
         *error_msg = db->error().message();
         return false;
@@ -166,102 +194,177 @@ bool HmSearch::init(const std::string& path,
         return false;
     }
 
-    if (!db->close()) {
+    if (id_bits) {
+        snprintf(buf, sizeof(buf), "%u", id_bits);
+        if (!db->set("_ib", buf)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
+    if (chunks.entries) {
+        snprintf(buf, sizeof(buf), "%d", chunks.entries);
+        if (!db->set("_ce", buf)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
+    if (chunks.compressed && !db->set("_cz", "1")) {
         *error_msg = db->error().message();
         return false;
     }
-    
+
+    if (!permutation.empty()) {
+        // Big-endian 16-bit bit numbers
+        std::string v;
+        for (size_t i = 0; i < permutation.size(); i++) {
+            v.push_back(permutation[i] >> 8);
+            v.push_back(permutation[i] & 0xff);
+        }
+
+        if (!db->set("_bp", v)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
     return true;
 }
 
 
-HmSearch* HmSearch::open(const std::string& path,
-                         OpenMode mode,
-                         std::string* error_msg)
+static bool init_database(const std::string& path,
+                          unsigned hash_bits, unsigned max_error,
+                          uint64_t num_hashes, unsigned id_bits,
+                          const std::vector<HmSearch::hash_string>& sample,
+                          unsigned flags, std::string* error_msg)
 {
-    std::string dummy;
-    if (!error_msg) {
-        error_msg = &dummy;
+    if (!check_settings(hash_bits, max_error, error_msg)) {
+        return false;
     }
-    *error_msg = "";
 
-    std::auto_ptr<kyotocabinet::PolyDB> db(new kyotocabinet::PolyDB);
+    for (size_t i = 0; i < sample.size(); i++) {
+        if (sample[i].length() != hash_bits / 8) {
+            *error_msg = "incorrect sample hash length";
+            return false;
+        }
+    }
+
+    std::vector<uint16_t> permutation;
+    if (!sample.empty()) {
+        choose_permutation(hash_bits, max_error, sample, permutation);
+    }
+
+    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
     if (!db.get()) {
-        return NULL;
+        return false;
     }
 
-    // Increase mmap from 64M to 512M
-    //db->tune_map(int64_t(512) << 20);
+    int partitions = (max_error + 3) / 2;
+    int partition_bits = ceil((double)hash_bits / partitions);
 
-    if (!db->open(path, (mode == READONLY ?
-                         kyotocabinet::BasicDB::OREADER :
-                         kyotocabinet::BasicDB::OWRITER))) {
-        *error_msg = db->error().message();
-        return NULL;
+    uint64_t hashes_per_partition = std::max(uint64_t(1), num_hashes / (uint64_t(1) << partition_bits));
+
+    // Posting lists are split into chunks of about CHUNK_BYTES, so
+    // that appending to a hot partition key doesn't rewrite the whole
+    // list
+    ChunkFormat chunks;
+    chunks.entry_bytes = id_bits ? id_bits / 8 : hash_bits / 8;
+    chunks.entries = std::max(1, CHUNK_BYTES / chunks.entry_bytes);
+    chunks.ids = id_bits != 0;
+    chunks.compressed = (flags & HmSearch::COMPRESS_CHUNKS) != 0;
+
+    uint64_t keys = (num_hashes / hashes_per_partition) * partitions;
+
+    // Plus the full chunks of the posting lists
+    keys += (num_hashes / chunks.entries) * partitions;
+
+    // Compact databases also have a record per hash
+    if (id_bits) {
+        keys += num_hashes;
     }
-    
-    std::string v;
-    unsigned long hash_bits, max_error;
-    if (!db->get("_hb", &v) || !(hash_bits = strtoul(v.c_str(), NULL, 10))) {
-        *error_msg = db->error().message();
-        return NULL;
+
+    tune_database(db.get(), keys);
+
+    if (!create_database(db.get(), path, hash_bits, max_error, id_bits,
+                         chunks, permutation, error_msg)) {
+        return false;
     }
-        
-    if (!db->get("_me", &v) || !(max_error = strtoul(v.c_str(), NULL, 10))) {
+
+    if (!db->close()) {
         *error_msg = db->error().message();
-        return NULL;
+        return false;
     }
+    
+    return true;
+}
 
-    HmSearch* hm = new HmSearchImpl(db.get(), hash_bits, max_error);
-    if (!hm) {
-        *error_msg = "out of memory";
-        return NULL;
-    }
 
-    db.release();
-    return hm;
+bool HmSearch::init(const std::string& path,
+                    unsigned hash_bits, unsigned max_error,
+                    uint64_t num_hashes,
+                    std::string* error_msg)
+{
+    return init(path, hash_bits, max_error, num_hashes,
+                std::vector<hash_string>(), 0, error_msg);
 }
 
 
-HmSearch::hash_string HmSearch::parse_hexhash(const std::string& hexhash)
+bool HmSearch::init(const std::string& path,
+                    unsigned hash_bits, unsigned max_error,
+                    uint64_t num_hashes,
+                    const std::vector<hash_string>& sample,
+                    std::string* error_msg)
 {
-    int len = hexhash.length() / 2;
-    uint8_t hash[len];
-    
-    for (int i = 0; i < len; i++) {
-        char buf[3];
-        char* err;
-        
-        buf[0] = hexhash[i * 2];
-        buf[1] = hexhash[i * 2 + 1];
-        buf[2] = 0;
+    return init(path, hash_bits, max_error, num_hashes, sample, 0, error_msg);
+}
 
-        hash[i] = strtoul(buf, &err, 16);
-        
-        if (*err != '\0') {
-            return hash_string();
-        }
+
+bool HmSearch::init(const std::string& path,
+                    unsigned hash_bits, unsigned max_error,
+                    uint64_t num_hashes,
+                    const std::vector<hash_string>& sample,
+                    unsigned flags,
+                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
     }
+    *error_msg = "";
 
-    return hash_string(hash, len);
+    return init_database(path, hash_bits, max_error, num_hashes, 0,
+                         sample, flags, error_msg);
 }
 
-std::string HmSearch::format_hexhash(const HmSearch::hash_string& hash)
-{
-    char hex[hash.length() * 2 + 1];
-
-    for (size_t i = 0; i < hash.length(); i++) {
-        sprintf(hex + 2 * i, "%02x", hash[i]);
-    }
 
-    return hex;
+bool HmSearch::init_compact(const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned id_bits,
+                            std::string* error_msg)
+{
+    return init_compact(path, hash_bits, max_error, num_hashes, id_bits,
+                        std::vector<hash_string>(), 0, error_msg);
 }
 
 
+bool HmSearch::init_compact(const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned id_bits,
+                            const std::vector<hash_string>& sample,
+                            std::string* error_msg)
+{
+    return init_compact(path, hash_bits, max_error, num_hashes, id_bits,
+                        sample, 0, error_msg);
+}
 
 
-bool HmSearchImpl::insert(const hash_string& hash,
-                          std::string* error_msg)
+bool HmSearch::init_compact(const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned id_bits,
+                            const std::vector<hash_string>& sample,
+                            unsigned flags,
+                            std::string* error_msg)
 {
     std::string dummy;
     if (!error_msg) {
@@ -269,36 +372,22 @@ bool HmSearchImpl::insert(const hash_string& hash,
     }
     *error_msg = "";
 
-    if (hash.length() != (size_t) _hash_bytes) {
-        *error_msg = "incorrect hash length";
-        return false;
-    }
-
-    if (!_db) {
-        *error_msg = "database is closed";
+    if (id_bits != 32 && id_bits != 64) {
+        *error_msg = "id_bits must be 32 or 64";
         return false;
     }
 
-    for (int i = 0; i < _partitions; i++) {
-        uint8_t key[_partition_bytes + 2];
-
-        get_partition_key(hash, i, key);
-
-        if (!_db->append((const char*) key, _partition_bytes + 2,
-                         (const char*) hash.data(), hash.length())) {
-            *error_msg = _db->error().message();
-            return false;
-        }
-    }
-
-    return true;
+    return init_database(path, hash_bits, max_error, num_hashes, id_bits,
+                         sample, flags, error_msg);
 }
 
 
-bool HmSearchImpl::lookup(const hash_string& query,
-                          LookupResultList& result,
-                          int reduced_error,
-                          std::string* error_msg)
+bool HmSearch::init_sharded(const std::string& path, unsigned shards,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned id_bits,
+                            const std::vector<hash_string>& sample,
+                            unsigned flags,
+                            std::string* error_msg)
 {
     std::string dummy;
     if (!error_msg) {
@@ -306,27 +395,53 @@ bool HmSearchImpl::lookup(const hash_string& query,
     }
     *error_msg = "";
 
-    if (query.length() != (size_t) _hash_bytes) {
-        *error_msg = "incorrect hash length";
+    if (shards < 1 || shards > MAX_SHARDS) {
+        *error_msg = "invalid number of shards";
         return false;
     }
 
-    if (!_db) {
-        *error_msg = "database is closed";
+    if (id_bits != 0 && id_bits != 32 && id_bits != 64) {
+        *error_msg = "id_bits must be 32 or 64";
         return false;
     }
 
-    CandidateMap candidates;
-    get_candidates(query, candidates);
+    if (!check_settings(hash_bits, max_error, error_msg)) {
+        return false;
+    }
 
-    for (CandidateMap::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
-        if (valid_candidate(i->second)) {
-            int distance = hamming_distance(query, i->first);
+    // The manifest is written first, so that an existing database
+    // isn't touched
+    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
+    if (!db.get()) {
+        return false;
+    }
 
-            if (distance <= _max_error
-                && (reduced_error < 0 || distance <= reduced_error)) {
-                result.push_back(LookupResult(i->first, distance));
-            }
+    if (!create_database(db.get(), path, hash_bits, max_error, 0, ChunkFormat(),
+                         std::vector<uint16_t>(), error_msg)) {
+        return false;
+    }
+
+    char buf[20];
+    snprintf(buf, sizeof(buf), "%u", shards);
+    if (!db->set("_sc", buf)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (!db->close()) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    uint64_t shard_hashes = (num_hashes + shards - 1) / shards;
+
+    for (unsigned i = 0; i < shards; i++) {
+        std::string shard = HmSearchSharded::shard_path(path, i);
+
+        if (!init_database(shard, hash_bits, max_error, shard_hashes, id_bits,
+                           sample, flags, error_msg)) {
+            *error_msg = shard + ": " + *error_msg;
+            return false;
         }
     }
 
@@ -334,7 +449,10 @@ bool HmSearchImpl::lookup(const hash_string& query,
 }
 
 
-bool HmSearchImpl::close(std::string* error_msg)
+HmSearch::Builder* HmSearch::create_builder(const std::string& path,
+                                            unsigned hash_bits, unsigned max_error,
+                                            size_t memory_limit,
+                                            std::string* error_msg)
 {
     std::string dummy;
     if (!error_msg) {
@@ -342,198 +460,2991 @@ bool HmSearchImpl::close(std::string* error_msg)
     }
     *error_msg = "";
 
-    if (!_db) {
-        // Already closed
-        return true;
+    if (!check_settings(hash_bits, max_error, error_msg)) {
+        return NULL;
     }
 
-    if (!_db->close()) {
-        *error_msg = _db->error().message();
-        return false;
+    Builder* builder = new HmSearchBuilder(path, hash_bits, max_error, memory_limit);
+    if (!builder) {
+        *error_msg = "out of memory";
+        return NULL;
     }
 
-    delete _db;
-    _db = NULL;
-
-    return true;
+    return builder;
 }
 
 
-void HmSearchImpl::dump()
+bool read_settings(kyotocabinet::BasicDB* db,
+                   unsigned long* hash_bits, unsigned long* max_error,
+                   unsigned long* id_bits, ChunkFormat* chunks,
+                   std::vector<uint16_t>* permutation,
+                   std::string* error_msg)
 {
-    kyotocabinet::BasicDB::Cursor *c = _db->cursor();
-
-    std::string key_str, value_str;
-
-    c->jump();
-    while (c->get(&key_str, &value_str, true)) {
-        uint8_t* key = (uint8_t*) key_str.data();
-        uint8_t* value = (uint8_t*) value_str.data();
+    std::string v;
+    if (!db->get("_hb", &v) || !(*hash_bits = strtoul(v.c_str(), NULL, 10))) {
+        *error_msg = db->error().message();
+        return false;
+    }
         
-        if (key[0] == 'P') {
-            std::cout << "Partition "
-                      << int(key[1])
-                      << format_hexhash(hash_string(key + 2, key_str.length() - 2))
-                      << std::endl;
+    if (!db->get("_me", &v) || !(*max_error = strtoul(v.c_str(), NULL, 10))) {
+        *error_msg = db->error().message();
+        return false;
+    }
 
-            for (long len = value_str.length(); len >= _hash_bytes;
-                 len -= _hash_bytes, value += _hash_bytes) {
-                std::cout << "    "
-                          << format_hexhash(hash_string(value, _hash_bytes))
-                          << std::endl;
-            }
-            std::cout << std::endl;
+    *id_bits = 0;
+    if (db->get("_ib", &v)) {
+        *id_bits = strtoul(v.c_str(), NULL, 10);
+        if (*id_bits != 32 && *id_bits != 64) {
+            *error_msg = "invalid hash ID size";
+            return false;
         }
     }
 
-    delete c;
-}
-
+    *chunks = ChunkFormat();
+    chunks->entry_bytes = *id_bits ? *id_bits / 8 : *hash_bits / 8;
+    chunks->ids = *id_bits != 0;
 
-void HmSearchImpl::get_candidates(
-    const HmSearchImpl::hash_string& query,
-    HmSearchImpl::CandidateMap& candidates)
-{
-    uint8_t key[_partition_bytes + 2];
-    
-    for (int i = 0; i < _partitions; i++) {
-        std::string hashes;
-        
-        int bits = get_partition_key(query, i, key);
+    if (db->get("_ce", &v)) {
+        chunks->entries = strtoul(v.c_str(), NULL, 10);
+        if (chunks->entries <= 0 || chunks->entries > (1 << 20)) {
+            *error_msg = "invalid posting list chunk size";
+            return false;
+        }
+    }
 
-        // Get exact matches
-        if (_db->get(std::string((const char*) key, _partition_bytes + 2), &hashes)) {
-            add_hash_candidates(candidates, 0, (const uint8_t*)hashes.data(), hashes.length());
+    if (db->get("_cz", &v)) {
+        if (v != "1" || !chunks->entries) {
+            *error_msg = "invalid posting list chunk compression";
+            return false;
         }
+        chunks->compressed = true;
+    }
 
-        // Get 1-variant matches
+    permutation->clear();
+    if (db->get("_bp", &v)) {
+        std::vector<bool> seen(*hash_bits);
+
+        if (v.size() != *hash_bits * 2) {
+            *error_msg = "invalid bit permutation";
+            return false;
+        }
+
+        for (size_t i = 0; i < *hash_bits; i++) {
+            uint16_t bit = ((uint8_t) v[i * 2] << 8) | (uint8_t) v[i * 2 + 1];
+
+            if (bit >= *hash_bits || seen[bit]) {
+                *error_msg = "invalid bit permutation";
+                return false;
+            }
+
+            seen[bit] = true;
+            permutation->push_back(bit);
+        }
+    }
+
+    return true;
+}
+
+
+HmSearch* HmSearch::open(const std::string& path,
+                         OpenMode mode,
+                         std::string* error_msg)
+{
+    return open(path, mode, OpenOptions(), error_msg);
+}
+
+
+HmSearch* HmSearch::open(const std::string& path,
+                         OpenMode mode,
+                         const OpenOptions& options,
+                         std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    Prewarmer* prewarmer = NULL;
+
+    if (HmSearchMapped::is_mapped_file(path)) {
+        if (mode == READWRITE) {
+            *error_msg = "mapped database is read-only";
+            return NULL;
+        }
+
+        if (mode == MEMORY) {
+            return HmSearchMapped::map_file(path, true, error_msg);
+        }
+
+        if (!Prewarmer::prewarm(path, options, &prewarmer, error_msg)) {
+            return NULL;
+        }
+
+        HmSearchMapped* hm = HmSearchMapped::map_file(path, false, error_msg);
+        if (!hm) {
+            delete prewarmer;
+            return NULL;
+        }
+
+        hm->set_prewarmer(prewarmer);
+        return hm;
+    }
+
+    std::auto_ptr<kyotocabinet::PolyDB> db(new kyotocabinet::PolyDB);
+    if (!db.get()) {
+        return NULL;
+    }
+
+    // PolyDB is tuned through parameters appended to the path, which
+    // the database types that don't know them ignore
+    std::string tuned_path = path;
+    char param[40];
+
+    if (options.map_size) {
+        snprintf(param, sizeof(param), "#msiz=%llu",
+                 (unsigned long long) options.map_size);
+        tuned_path += param;
+    }
+
+    if (options.page_cache) {
+        snprintf(param, sizeof(param), "#pccap=%llu",
+                 (unsigned long long) options.page_cache);
+        tuned_path += param;
+    }
+
+    if (!db->open(tuned_path, (mode == READWRITE ?
+                         kyotocabinet::BasicDB::OWRITER :
+                         kyotocabinet::BasicDB::OREADER))) {
+        *error_msg = db->error().message();
+        return NULL;
+    }
+    
+    unsigned long hash_bits, max_error, id_bits;
+    ChunkFormat chunks;
+    std::vector<uint16_t> permutation;
+    if (!read_settings(db.get(), &hash_bits, &max_error, &id_bits,
+                       &chunks, &permutation, error_msg)) {
+        return NULL;
+    }
+
+    std::string shards;
+    if (db->get("_sc", &shards)) {
+        unsigned long count = strtoul(shards.c_str(), NULL, 10);
+        if (count < 1 || count > MAX_SHARDS) {
+            *error_msg = "invalid number of shards";
+            return NULL;
+        }
+
+        // The manifest is only needed to find the shards
+        if (!db->close()) {
+            *error_msg = db->error().message();
+            return NULL;
+        }
+
+        return HmSearchSharded::open_shards(path, count, hash_bits, max_error,
+                                            mode, options, error_msg);
+    }
+
+    if (mode == MEMORY) {
+        if (id_bits) {
+            *error_msg = "compact databases can't be loaded into memory";
+            return NULL;
+        }
+
+        std::auto_ptr<HmSearchMemory> hm(new HmSearchMemory(hash_bits, max_error));
+        if (!hm.get()) {
+            *error_msg = "out of memory";
+            return NULL;
+        }
+
+        hm->set_permutation(permutation);
+
+        if (!hm->load(db.get(), chunks, error_msg)) {
+            return NULL;
+        }
+
+        if (!db->close()) {
+            *error_msg = db->error().message();
+            return NULL;
+        }
+
+        return hm.release();
+    }
+
+    if (!Prewarmer::prewarm(path, options, &prewarmer, error_msg)) {
+        return NULL;
+    }
+
+    HmSearchImpl* hm = new HmSearchImpl(db.get(), hash_bits, max_error, id_bits,
+                                        chunks);
+    if (!hm) {
+        *error_msg = "out of memory";
+        delete prewarmer;
+        return NULL;
+    }
+
+    hm->set_permutation(permutation);
+    hm->set_prewarmer(prewarmer);
+
+    db.release();
+    return hm;
+}
+
+
+bool Prewarmer::prewarm(const std::string& path,
+                        const HmSearch::OpenOptions& options,
+                        Prewarmer** background,
+                        std::string* error_msg)
+{
+    *background = NULL;
+
+    if (options.prewarm == HmSearch::PREWARM_NONE) {
+        return true;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    // Let the kernel read ahead as far as it likes.  This only
+    // affects this descriptor, not the one the database reads with.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    Prewarmer* prewarmer = new Prewarmer(path, fd, st.st_size, options.callback);
+
+    if (options.prewarm == HmSearch::PREWARM_WAIT) {
+        prewarmer->run();
+        delete prewarmer;
+        return true;
+    }
+
+    prewarmer->_started = true;
+    prewarmer->start();
+    *background = prewarmer;
+    return true;
+}
+
+
+Prewarmer::~Prewarmer()
+{
+    if (_started) {
+        _stop.set(1);
+        join();
+    }
+
+    ::close(_fd);
+}
+
+
+void Prewarmer::run()
+{
+    std::vector<char> block(PREWARM_BLOCK_BYTES);
+    uint64_t done = 0;
+    uint64_t next_report = PREWARM_REPORT_BYTES;
+
+    while (done < _size && !_stop.get()) {
+        ssize_t n = pread(_fd, &block[0], block.size(), done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // Prewarming is only an optimisation, so a read error or a
+        // file that shrank just ends it
+        if (n <= 0) {
+            break;
+        }
+
+        done += n;
+
+        if (_callback && (done >= next_report || done >= _size)) {
+            _callback->progress(_path, done, _size);
+            next_report = done + PREWARM_REPORT_BYTES;
+        }
+    }
+}
+
+
+/** Values of hexadecimal digits, with bit 8 set for characters that
+ * are not digits.
+ */
+class HexDigits
+{
+public:
+    HexDigits() {
+        for (int c = 0; c < 256; c++) {
+            values[c] = 0x100;
+        }
+        for (int i = 0; i < 10; i++) {
+            values['0' + i] = i;
+        }
+        for (int i = 0; i < 6; i++) {
+            values['a' + i] = values['A' + i] = 10 + i;
+        }
+    }
+
+    uint16_t values[256];
+};
+
+static const HexDigits hex_digits;
+
+
+HmSearch::hash_string HmSearch::parse_hexhash(const std::string& hexhash)
+{
+    int len = hexhash.length() / 2;
+    uint8_t hash[len];
+
+    if (!parse_hexhash(hexhash.data(), len * 2, hash)) {
+        return hash_string();
+    }
+
+    return hash_string(hash, len);
+}
+
+bool HmSearch::parse_hexhash(const char* hexhash, size_t length, uint8_t* hash)
+{
+    const uint8_t* hex = (const uint8_t*) hexhash;
+    unsigned invalid = 0;
+
+    for (size_t i = 0; i < length / 2; i++) {
+        unsigned value = (hex_digits.values[hex[i * 2]] << 4) | hex_digits.values[hex[i * 2 + 1]];
+
+        // Check for invalid digits once at the end
+        invalid |= value;
+        hash[i] = value;
+    }
+
+    return (invalid & 0x1f00) == 0;
+}
+
+std::string HmSearch::format_hexhash(const HmSearch::hash_string& hash)
+{
+    char hex[hash.length() * 2 + 1];
+
+    format_hexhash(hash.data(), hash.length(), hex);
+
+    return std::string(hex, hash.length() * 2);
+}
+
+void HmSearch::format_hexhash(const uint8_t* hash, size_t length, char* hexhash)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < length; i++) {
+        hexhash[i * 2] = digits[hash[i] >> 4];
+        hexhash[i * 2 + 1] = digits[hash[i] & 0xf];
+    }
+}
+
+
+
+
+bool HmSearchImpl::insert(const hash_string& hash,
+                          std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != (size_t) _hash_bytes) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_db) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    bool buffered;
+    {
+        // set_write_buffer() may change the buffer size concurrently
+        kyotocabinet::ScopedMutex lock(&_buffer_lock);
+
+        buffered = _buffer_size > 0;
+        if (buffered) {
+            // IDs are allocated for the whole buffer when it is written
+            _buffer_hashes.push_back(hash);
+            if (_buffer_hashes.size() < _buffer_size) {
+                return true;
+            }
+        }
+    }
+
+    if (buffered) {
+        return flush_buffer(error_msg);
+    }
+
+    uint64_t id;
+    if (!allocate_ids(1, &id, error_msg)) {
+        return false;
+    }
+
+    uint8_t entry[_entry_bytes];
+    get_entry(hash, id, entry);
+
+    // Store the hash before any partition record refers to it
+    if (_id_bytes && !_db->set(hash_key(entry),
+                               std::string((const char*) hash.data(), hash.length()))) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    uint8_t permuted[_hash_bytes];
+    const uint8_t* phash = partition_hash(hash.data(), permuted);
+
+    for (int i = 0; i < _partitions; i++) {
+        uint8_t key[_partition_bytes + 2];
+
+        get_partition_key(phash, i, key);
+
+        if (!append_partition((const char*) key, (const char*) entry, _entry_bytes,
+                              error_msg)) {
+            invalidate_cache();
+            return false;
+        }
+    }
+
+    invalidate_cache();
+    return true;
+}
+
+
+bool HmSearchImpl::insert_batch(const std::vector<hash_string>& hashes,
+                                std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (hashes[i].length() != (size_t) _hash_bytes) {
+            *error_msg = "incorrect hash length";
+            return false;
+        }
+    }
+
+    if (!_db) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    uint64_t first_id;
+    if (!allocate_ids(hashes.size(), &first_id, error_msg)) {
+        return false;
+    }
+
+    PartitionBuffer buffer;
+    uint8_t entry[_entry_bytes];
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        get_entry(hashes[i], first_id + i, entry);
+        buffer_partitions(buffer, hashes[i], entry);
+    }
+
+    return write_partitions(buffer, error_msg);
+}
+
+
+bool HmSearchImpl::set_write_buffer(size_t max_hashes,
+                                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    bool full;
+    {
+        kyotocabinet::ScopedMutex lock(&_buffer_lock);
+
+        _buffer_size = max_hashes;
+        full = !_buffer_hashes.empty() && _buffer_hashes.size() >= _buffer_size;
+    }
+
+    if (full) {
+        return flush_buffer(error_msg);
+    }
+
+    return true;
+}
+
+
+bool HmSearchImpl::flush(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_db) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return flush_buffer(error_msg);
+}
+
+
+bool HmSearchImpl::allocate_ids(size_t count, uint64_t* first_id,
+                                std::string* error_msg)
+{
+    if (!_id_bytes) {
+        *first_id = 0;
+        return true;
+    }
+
+    int64_t next = _db->increment("_ni", count);
+    if (next == kyotocabinet::INT64MIN) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    if (_id_bytes < 8 && uint64_t(next) > (uint64_t(1) << (_id_bytes * 8))) {
+        *error_msg = "out of hash IDs";
+        return false;
+    }
+
+    *first_id = next - count;
+    return true;
+}
+
+
+void HmSearchImpl::get_entry(const hash_string& hash, uint64_t id,
+                             uint8_t* entry) const
+{
+    if (!_id_bytes) {
+        memcpy(entry, hash.data(), _hash_bytes);
+        return;
+    }
+
+    for (int i = _id_bytes - 1; i >= 0; i--) {
+        entry[i] = id & 0xff;
+        id >>= 8;
+    }
+}
+
+
+std::string HmSearchImpl::hash_key(const uint8_t* id) const
+{
+    std::string key(1, 'H');
+    key.append((const char*) id, _id_bytes);
+    return key;
+}
+
+
+void HmSearchImpl::buffer_partitions(PartitionBuffer& buffer, const hash_string& hash,
+                                     const uint8_t* entry)
+{
+    uint8_t key[_partition_bytes + 2];
+    uint8_t permuted[_hash_bytes];
+    const uint8_t* phash = partition_hash(hash.data(), permuted);
+
+    if (_id_bytes) {
+        buffer[hash_key(entry)].assign((const char*) hash.data(), hash.length());
+    }
+
+    for (int i = 0; i < _partitions; i++) {
+        get_partition_key(phash, i, key);
+
+        buffer[std::string((const char*) key, _partition_bytes + 2)]
+            .append((const char*) entry, _entry_bytes);
+    }
+}
+
+
+bool HmSearchImpl::write_partitions(PartitionBuffer& buffer, std::string* error_msg)
+{
+    // Written keys are removed one by one, so after an error the
+    // buffer only holds the hashes that still need appending.  Hash
+    // records ('H') sort before the partition records ('P') referring
+    // to them, so they are written first.
+    while (!buffer.empty()) {
+        PartitionBuffer::iterator i = buffer.begin();
+
+        if (i->first[0] == 'P') {
+            if (!append_partition(i->first.data(), i->second.data(), i->second.length(),
+                                  error_msg)) {
+                invalidate_cache();
+                return false;
+            }
+        }
+        else if (!_db->append(i->first, i->second)) {
+            *error_msg = _db->error().message();
+            invalidate_cache();
+            return false;
+        }
+
+        buffer.erase(i);
+    }
+
+    invalidate_cache();
+    return true;
+}
+
+
+/** Write the buffered hashes, allocating their IDs in one go.  The
+ * buffer is taken over under _buffer_lock and written without it, so
+ * other inserters can keep filling a new buffer meanwhile.  On errors
+ * whatever wasn't written is put back, to be retried by the next
+ * flush.
+ */
+bool HmSearchImpl::flush_buffer(std::string* error_msg)
+{
+    std::vector<hash_string> hashes;
+    PartitionBuffer buffer;
+    {
+        kyotocabinet::ScopedMutex lock(&_buffer_lock);
+        hashes.swap(_buffer_hashes);
+        buffer.swap(_buffer);
+    }
+
+    bool ok = true;
+
+    if (!hashes.empty()) {
+        uint64_t first_id;
+        ok = allocate_ids(hashes.size(), &first_id, error_msg);
+
+        if (ok) {
+            uint8_t entry[_entry_bytes];
+            for (size_t i = 0; i < hashes.size(); i++) {
+                get_entry(hashes[i], first_id + i, entry);
+                buffer_partitions(buffer, hashes[i], entry);
+            }
+            hashes.clear();
+        }
+    }
+
+    if (ok) {
+        ok = write_partitions(buffer, error_msg);
+    }
+
+    if (!ok) {
+        kyotocabinet::ScopedMutex lock(&_buffer_lock);
+
+        _buffer_hashes.insert(_buffer_hashes.end(), hashes.begin(), hashes.end());
+        for (PartitionBuffer::iterator i = buffer.begin(); i != buffer.end(); ++i) {
+            _buffer[i->first].append(i->second);
+        }
+    }
+
+    return ok;
+}
+
+
+/** Appends entries to the tail of a chunked partition record,
+ * creating the record with no full chunks if it doesn't exist.
+ */
+class HeadAppendVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    HeadAppendVisitor(const char* entries, size_t length)
+        : _entries(entries), _length(length)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        _record.reserve(vsiz + _length);
+        _record.assign(vbuf, vsiz);
+        _record.append(_entries, _length);
+        *sp = _record.length();
+        return _record.data();
+    }
+
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+        _record.assign(CHUNK_HEADER_BYTES, 0);
+        _record.append(_entries, _length);
+        *sp = _record.length();
+        return _record.data();
+    }
+
+    // Length of the tail after the append
+    size_t tail_length() const { return _record.length() - CHUNK_HEADER_BYTES; }
+
+private:
+    const char* _entries;
+    size_t _length;
+    std::string _record;
+};
+
+
+/** Drops the first chunk from the tail of a partition record and
+ * counts it as a full chunk, unless another writer got there first.
+ */
+class ChunkMoveVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    ChunkMoveVisitor(uint32_t chunk, size_t chunk_bytes)
+        : _chunk(chunk), _chunk_bytes(chunk_bytes), _moved(false)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        if (vsiz < CHUNK_HEADER_BYTES + _chunk_bytes || get_chunk_count(vbuf) != _chunk) {
+            return NOP;
+        }
+
+        _record.assign(CHUNK_HEADER_BYTES, 0);
+        put_chunk_count(&_record[0], _chunk + 1);
+        _record.append(vbuf + CHUNK_HEADER_BYTES + _chunk_bytes,
+                       vsiz - CHUNK_HEADER_BYTES - _chunk_bytes);
+        _moved = true;
+
+        *sp = _record.length();
+        return _record.data();
+    }
+
+    bool moved() const { return _moved; }
+
+private:
+    uint32_t _chunk;
+    size_t _chunk_bytes;
+    bool _moved;
+    std::string _record;
+};
+
+
+bool HmSearchImpl::append_partition(const char* key, const char* entries, size_t length,
+                                    std::string* error_msg)
+{
+    if (!_chunks.entries) {
+        if (!_db->append(key, key_length(), entries, length)) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+        return true;
+    }
+
+    HeadAppendVisitor visitor(entries, length);
+
+    if (!_db->accept(key, key_length(), &visitor, true)) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    if (visitor.tail_length() >= _chunks.bytes()) {
+        return move_full_chunks(key, error_msg);
+    }
+
+    return true;
+}
+
+
+bool HmSearchImpl::move_full_chunks(const char* key, std::string* error_msg)
+{
+    size_t chunk_bytes = _chunks.bytes();
+    std::string head, record;
+
+    // Serialise the moves, so that each chunk is written once.
+    // Appends only add to the end of the tail, so the chunk copied
+    // below is still at the start of it when the head is updated.
+    kyotocabinet::ScopedMutex lock(&_chunk_lock);
+
+    while (true) {
+        if (!_db->get(std::string(key, key_length()), &head)) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+
+        if (head.length() < CHUNK_HEADER_BYTES + chunk_bytes) {
+            return true;
+        }
+
+        // Lookups only read chunks below the count in the head, so
+        // the chunk record must be complete before the count covers it
+        uint32_t chunk = get_chunk_count(head.data());
+        _chunks.encode((const uint8_t*) head.data() + CHUNK_HEADER_BYTES, record);
+
+        if (!_db->set(chunk_key(key, chunk), record)) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+
+        ChunkMoveVisitor visitor(chunk, chunk_bytes);
+        if (!_db->accept(key, key_length(), &visitor, true)) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+
+        if (!visitor.moved()) {
+            *error_msg = "partition record changed while moving a chunk";
+            return false;
+        }
+    }
+}
+
+
+std::string HmSearchImpl::chunk_key(const char* key, uint32_t chunk) const
+{
+    std::string ckey(key, key_length());
+    ckey[0] = 'C';
+    ckey.append(CHUNK_HEADER_BYTES, 0);
+    put_chunk_count(&ckey[key_length()], chunk);
+    return ckey;
+}
+
+
+/** Orders pointers to posting list entries by the entries.
+ */
+struct EntryLess {
+    EntryLess(int b) : bytes(b) {}
+
+    bool operator()(const uint8_t* a, const uint8_t* b) const {
+        return memcmp(a, b, bytes) < 0;
+    }
+
+    int bytes;
+};
+
+
+void ChunkFormat::encode(const uint8_t* chunk, std::string& record) const
+{
+    if (!compressed) {
+        record.assign((const char*) chunk, bytes());
+        return;
+    }
+
+    std::vector<const uint8_t*> order(entries);
+    for (int i = 0; i < entries; i++) {
+        order[i] = chunk + i * entry_bytes;
+    }
+    std::sort(order.begin(), order.end(), EntryLess(entry_bytes));
+
+    record.clear();
+
+    if (ids) {
+        // Varint deltas between the sorted IDs
+        uint64_t prev = 0;
+
+        for (int i = 0; i < entries; i++) {
+            uint64_t id = 0;
+            for (int j = 0; j < entry_bytes; j++) {
+                id = (id << 8) | order[i][j];
+            }
+
+            uint64_t delta = id - prev;
+            prev = id;
+
+            while (delta >= 0x80) {
+                record.push_back(char(delta | 0x80));
+                delta >>= 7;
+            }
+            record.push_back(char(delta));
+        }
+        return;
+    }
+
+    // A bitmap of the bytes that differ from the previous hash,
+    // followed by those bytes XORed with the previous hash
+    int bitmap_bytes = (entry_bytes + 7) / 8;
+    uint8_t zero[entry_bytes];
+    memset(zero, 0, entry_bytes);
+    const uint8_t* prev = zero;
+
+    for (int i = 0; i < entries; i++) {
+        size_t bitmap = record.length();
+        record.append(bitmap_bytes, 0);
+
+        for (int j = 0; j < entry_bytes; j++) {
+            uint8_t diff = order[i][j] ^ prev[j];
+            if (diff) {
+                record[bitmap + j / 8] |= 1 << (j % 8);
+                record.push_back(char(diff));
+            }
+        }
+
+        prev = order[i];
+    }
+}
+
+
+bool ChunkFormat::decode(const char* record, size_t length, uint8_t* chunk) const
+{
+    if (!compressed) {
+        if (length != bytes()) {
+            return false;
+        }
+        memcpy(chunk, record, length);
+        return true;
+    }
+
+    const uint8_t* p = (const uint8_t*) record;
+    const uint8_t* end = p + length;
+
+    if (ids) {
+        uint64_t id = 0;
+
+        for (int i = 0; i < entries; i++) {
+            uint64_t delta = 0;
+            int shift = 0;
+
+            do {
+                if (p == end || shift > 63) {
+                    return false;
+                }
+                delta |= uint64_t(*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+
+            id += delta;
+
+            uint64_t v = id;
+            for (int j = entry_bytes - 1; j >= 0; j--) {
+                chunk[i * entry_bytes + j] = v & 0xff;
+                v >>= 8;
+            }
+        }
+
+        return p == end;
+    }
+
+    int bitmap_bytes = (entry_bytes + 7) / 8;
+    uint8_t* entry = chunk;
+
+    memset(entry, 0, entry_bytes);
+
+    for (int i = 0; i < entries; i++, entry += entry_bytes) {
+        if (i > 0) {
+            memcpy(entry, entry - entry_bytes, entry_bytes);
+        }
+
+        if (end - p < bitmap_bytes) {
+            return false;
+        }
+
+        const uint8_t* bitmap = p;
+        p += bitmap_bytes;
+
+        for (int b = 0; b < bitmap_bytes; b++) {
+            for (unsigned bits = bitmap[b]; bits; bits &= bits - 1) {
+                int j = b * 8 + __builtin_ctz(bits);
+                if (j >= entry_bytes || p == end) {
+                    return false;
+                }
+                entry[j] ^= *p++;
+            }
+        }
+    }
+
+    return p == end;
+}
+
+
+bool HmSearchImpl::close(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_db) {
+        // Already closed
+        return true;
+    }
+
+    // Write any buffered hashes, but close the database even if
+    // that fails
+    bool flushed = flush(error_msg);
+
+    if (!_db->close()) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    delete _db;
+    _db = NULL;
+
+    return flushed;
+}
+
+
+void HmSearchImpl::dump()
+{
+    kyotocabinet::BasicDB::Cursor *c = _db->cursor();
+
+    std::string key_str, value_str, hash_str;
+
+    c->jump();
+    while (c->get(&key_str, &value_str, true)) {
+        uint8_t* key = (uint8_t*) key_str.data();
+        uint8_t* value = (uint8_t*) value_str.data();
+        
+        if (key[0] == 'P') {
+            std::cout << "Partition "
+                      << int(key[1])
+                      << format_hexhash(hash_string(key + 2, key_str.length() - 2))
+                      << '\n';
+
+            // Chunked posting lists are collected from their records
+            size_t length = value_str.length();
+            if (_chunks.entries) {
+                const uint8_t* hashes;
+                if (!get_posting_list(key, value_str, &hashes, &length)) {
+                    std::cout << "    cannot read posting list\n\n";
+                    continue;
+                }
+                value = (uint8_t*) hashes;
+            }
+
+            for (long len = length; len >= _entry_bytes;
+                 len -= _entry_bytes, value += _entry_bytes) {
+                const uint8_t* hash = value;
+                if (_id_bytes && !get_hash(value, hash_str, &hash)) {
+                    continue;
+                }
+
+                std::cout << "    "
+                          << format_hexhash(hash_string(hash, _hash_bytes))
+                          << '\n';
+            }
+            std::cout << '\n';
+        }
+    }
+
+    delete c;
+}
+
+
+/** Copies a record value straight into a lookup buffer.
+ */
+class ValueCopyVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    ValueCopyVisitor(std::string& buffer)
+        : _buffer(buffer), _found(false)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        _buffer.assign(vbuf, vsiz);
+        _found = true;
+        return NOP;
+    }
+
+    bool found() const { return _found; }
+
+private:
+    std::string& _buffer;
+    bool _found;
+};
+
+
+/** Decodes a full chunk into its place in a lookup buffer.
+ */
+class ChunkCopyVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    ChunkCopyVisitor(const ChunkFormat& format, char* chunk)
+        : _format(format), _chunk(chunk), _found(false)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        _found = _format.decode(vbuf, vsiz, (uint8_t*) _chunk);
+        return NOP;
+    }
+
+    bool found() const { return _found; }
+
+private:
+    const ChunkFormat& _format;
+    char* _chunk;
+    bool _found;
+};
+
+
+/** Copies the records of a bulk fetch into the buffers of their
+ * keys.  Kyoto Cabinet visits the keys in the order given, which is
+ * checked rather than relied on.
+ */
+class BulkCopyVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    BulkCopyVisitor(const std::vector<std::string>& keys, std::string* buffers)
+        : _keys(keys), _buffers(buffers), _found(keys.size()), _next(0), _in_order(true)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        if (expected(kbuf, ksiz)) {
+            _buffers[_next].assign(vbuf, vsiz);
+            _found[_next] = true;
+        }
+        _next++;
+        return NOP;
+    }
+
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+        expected(kbuf, ksiz);
+        _next++;
+        return NOP;
+    }
+
+    bool in_order() const { return _in_order && _next == _keys.size(); }
+    bool found(size_t i) const { return _found[i]; }
+
+private:
+    bool expected(const char* kbuf, size_t ksiz) {
+        if (_next >= _keys.size()
+            || ksiz != _keys[_next].length()
+            || memcmp(kbuf, _keys[_next].data(), ksiz) != 0) {
+            _in_order = false;
+        }
+        return _in_order;
+    }
+
+    const std::vector<std::string>& _keys;
+    std::string* _buffers;
+    std::vector<bool> _found;
+    size_t _next;
+    bool _in_order;
+};
+
+
+/** Decodes the full chunks of a bulk fetch into their places in the
+ * lookup buffers.
+ */
+class BulkChunkVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    BulkChunkVisitor(const ChunkFormat& format, const std::vector<std::string>& keys,
+                     const std::vector<char*>& chunks)
+        : _format(format), _keys(keys), _chunks(chunks), _next(0), _ok(true)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        if (!expected(kbuf, ksiz)
+            || !_format.decode(vbuf, vsiz, (uint8_t*) _chunks[_next])) {
+            _ok = false;
+        }
+        _next++;
+        return NOP;
+    }
+
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+        _ok = false;
+        _next++;
+        return NOP;
+    }
+
+    /** Return true if all chunks were found and decoded. */
+    bool ok() const { return _ok && _next == _keys.size(); }
+
+private:
+    bool expected(const char* kbuf, size_t ksiz) const {
+        return (_next < _keys.size()
+                && ksiz == _keys[_next].length()
+                && memcmp(kbuf, _keys[_next].data(), ksiz) == 0);
+    }
+
+    const ChunkFormat& _format;
+    const std::vector<std::string>& _keys;
+    const std::vector<char*>& _chunks;
+    size_t _next;
+    bool _ok;
+};
+
+
+/** Make room for the full chunks of a posting list in front of its
+ * tail, in a buffer holding the head record.  Returns the number of
+ * chunks to read, or -1 if the head is invalid.
+ */
+long HmSearchImpl::make_chunk_space(std::string& buffer) const
+{
+    if (buffer.length() < CHUNK_HEADER_BYTES) {
+        return -1;
+    }
+
+    // Chunks are never changed once the head counts them, so the
+    // head is a consistent view of the posting list
+    uint32_t chunks = get_chunk_count(buffer.data());
+
+    if (chunks > 0) {
+        size_t chunk_bytes = _chunks.bytes();
+        size_t tail = buffer.length() - CHUNK_HEADER_BYTES;
+
+        buffer.resize(CHUNK_HEADER_BYTES + chunks * chunk_bytes + tail);
+        memmove(&buffer[CHUNK_HEADER_BYTES + chunks * chunk_bytes],
+                &buffer[CHUNK_HEADER_BYTES], tail);
+    }
+
+    return chunks;
+}
+
+
+bool HmSearchImpl::get_posting_list(const uint8_t* key, std::string& buffer,
+                                    const uint8_t** hashes, size_t* length)
+{
+    ValueCopyVisitor visitor(buffer);
+
+    if (!_db->accept((const char*) key, key_length(), &visitor, false)
+        || !visitor.found()) {
+        return false;
+    }
+
+    if (!_chunks.entries) {
+        *hashes = (const uint8_t*) buffer.data();
+        *length = buffer.length();
+        return true;
+    }
+
+    long chunks = make_chunk_space(buffer);
+    if (chunks < 0) {
+        return false;
+    }
+
+    for (long i = 0; i < chunks; i++) {
+        std::string ckey = chunk_key((const char*) key, i);
+        ChunkCopyVisitor chunk_visitor(_chunks, &buffer[CHUNK_HEADER_BYTES + i * _chunks.bytes()]);
+
+        if (!_db->accept(ckey.data(), ckey.length(), &chunk_visitor, false)
+            || !chunk_visitor.found()) {
+            return false;
+        }
+    }
+
+    *hashes = (const uint8_t*) buffer.data() + CHUNK_HEADER_BYTES;
+    *length = buffer.length() - CHUNK_HEADER_BYTES;
+    return true;
+}
+
+
+void HmSearchImpl::get_posting_lists(const uint8_t* keys, size_t count,
+                                     std::string* buffers,
+                                     const uint8_t** hashes, size_t* lengths)
+{
+    int klen = key_length();
+    std::vector<std::string> heads(count);
+
+    for (size_t i = 0; i < count; i++) {
+        heads[i].assign((const char*) keys + i * klen, klen);
+    }
+
+    // Fetch all heads in one call, so Kyoto Cabinet takes its locks
+    // once and the reads of the records follow each other directly
+    BulkCopyVisitor visitor(heads, buffers);
+
+    if (!_db->accept_bulk(heads, &visitor, false) || !visitor.in_order()) {
+        HmSearchBase::get_posting_lists(keys, count, buffers, hashes, lengths);
+        return;
+    }
+
+    // Then all full chunks of the chunked posting lists in a second
+    // call
+    std::vector<std::string> chunk_keys;
+    std::vector<char*> chunks;
+
+    for (size_t i = 0; i < count; i++) {
+        std::string& buffer = buffers[i];
+        hashes[i] = NULL;
+
+        if (!visitor.found(i)) {
+            continue;
+        }
+
+        if (!_chunks.entries) {
+            hashes[i] = (const uint8_t*) buffer.data();
+            lengths[i] = buffer.length();
+            continue;
+        }
+
+        long n = make_chunk_space(buffer);
+        if (n < 0) {
+            continue;
+        }
+
+        for (long c = 0; c < n; c++) {
+            chunk_keys.push_back(chunk_key(heads[i].data(), c));
+            chunks.push_back(&buffer[CHUNK_HEADER_BYTES + c * _chunks.bytes()]);
+        }
+
+        hashes[i] = (const uint8_t*) buffer.data() + CHUNK_HEADER_BYTES;
+        lengths[i] = buffer.length() - CHUNK_HEADER_BYTES;
+    }
+
+    if (!chunk_keys.empty()) {
+        BulkChunkVisitor chunk_visitor(_chunks, chunk_keys, chunks);
+
+        // A chunk that can't be read fails its posting list, which
+        // is easiest to sort out one key at a time
+        if (!_db->accept_bulk(chunk_keys, &chunk_visitor, false) || !chunk_visitor.ok()) {
+            HmSearchBase::get_posting_lists(keys, count, buffers, hashes, lengths);
+        }
+    }
+}
+
+
+bool HmSearchImpl::get_hash(const uint8_t* id, std::string& buffer,
+                            const uint8_t** hash)
+{
+    ValueCopyVisitor visitor(buffer);
+    std::string key = hash_key(id);
+
+    if (!_db->accept(key.data(), key.length(), &visitor, false)
+        || !visitor.found() || buffer.length() != (size_t) _hash_bytes) {
+        return false;
+    }
+
+    *hash = (const uint8_t*) buffer.data();
+    return true;
+}
+
+
+bool HmSearchBase::lookup(const hash_string& query,
+                          LookupResultList& result,
+                          int reduced_error,
+                          std::string* error_msg,
+                          LookupStats* stats)
+{
+    ResultCollector collector(result, _hash_bytes);
+    LookupStats s;
+
+    if (!find_matches(query, reduced_error, collector, &result, error_msg, s)) {
+        return false;
+    }
+
+    add_stats(s, stats);
+    return true;
+}
+
+
+bool HmSearchBase::lookup(const hash_string& query,
+                          LookupCallback& callback,
+                          int reduced_error,
+                          std::string* error_msg,
+                          LookupStats* stats)
+{
+    LookupStats s;
+
+    if (!find_matches(query, reduced_error, callback, NULL, error_msg, s)) {
+        return false;
+    }
+
+    add_stats(s, stats);
+    return true;
+}
+
+
+/** Look up query, passing the matches to callback.  If the matches
+ * are collected in result, room is reserved in it for the candidates
+ * that will be verified.
+ */
+bool HmSearchBase::find_matches(const hash_string& query, int reduced_error,
+                                LookupCallback& callback, LookupResultList* result,
+                                std::string* error_msg, LookupStats& stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != (size_t) _hash_bytes) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!is_open()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    int max_distance = effective_max_error(reduced_error);
+    int64_t generation = _cache_generation.get();
+    std::auto_ptr<ResultRecorder> recorder;
+
+    stats.lookups++;
+
+    if (_cache) {
+        if (result) {
+            size_t start = result->size();
+            if (_cache->get(query, max_distance, generation, *result)) {
+                stats.matches += result->size() - start;
+                return true;
+            }
+        }
+        else {
+            LookupResultList cached;
+            if (_cache->get(query, max_distance, generation, cached)) {
+                for (LookupResultList::const_iterator i = cached.begin();
+                     i != cached.end();
+                     ++i) {
+                    stats.matches++;
+                    if (!callback.match(i->hash.data(), i->distance)) {
+                        break;
+                    }
+                }
+                return true;
+            }
+        }
+
+        recorder.reset(new ResultRecorder(callback, _hash_bytes));
+    }
+
+    CandidateTable candidates(_entry_bytes);
+    std::vector<PartitionTask*> tasks;
+    PostingBuffers* buffers = NULL;
+
+    if (_lookup_queue && _partitions > 1) {
+        get_candidates_parallel(query, tasks, candidates, stats);
+    }
+    else {
+        buffers = acquire_buffers();
+        get_candidates(query, 0, _partitions, *buffers, candidates, stats);
+    }
+
+    if (result) {
+        result->reserve(result->size() + count_valid_candidates(candidates));
+    }
+
+    if (recorder.get()) {
+        verify_candidates(query, candidates, max_distance, *recorder, stats);
+
+        // A lookup stopped by the callback may have missed matches
+        if (recorder->complete) {
+            _cache->put(query, max_distance, generation, recorder->result);
+        }
+    }
+    else {
+        verify_candidates(query, candidates, max_distance, callback, stats);
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        delete tasks[i];
+    }
+
+    if (buffers) {
+        release_buffers(buffers);
+    }
+
+    return true;
+}
+
+
+bool HmSearchBase::lookup_batch(const std::vector<hash_string>& queries,
+                                std::vector<LookupResultList>& results,
+                                int reduced_error,
+                                std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        if (queries[q].length() != (size_t) _hash_bytes) {
+            *error_msg = "incorrect hash length";
+            return false;
+        }
+    }
+
+    if (!is_open()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (queries.empty()) {
+        results.clear();
+        return true;
+    }
+
+    int max_distance = effective_max_error(reduced_error);
+    LookupStats stats;
+
+    results.resize(queries.size());
+    stats.lookups = queries.size();
+
+    if (!_cache) {
+        find_batch_matches(queries, max_distance, results, stats);
+        add_stats(stats, NULL);
+        return true;
+    }
+
+    // Only look up the queries that aren't cached
+    int64_t generation = _cache_generation.get();
+    std::vector<hash_string> misses;
+    std::vector<size_t> miss_index;
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        size_t start = results[q].size();
+
+        if (_cache->get(queries[q], max_distance, generation, results[q])) {
+            stats.matches += results[q].size() - start;
+        }
+        else {
+            misses.push_back(queries[q]);
+            miss_index.push_back(q);
+        }
+    }
+
+    std::vector<LookupResultList> found(misses.size());
+    if (!misses.empty()) {
+        find_batch_matches(misses, max_distance, found, stats);
+    }
+
+    for (size_t i = 0; i < misses.size(); i++) {
+        LookupResultList& r = results[miss_index[i]];
+
+        _cache->put(misses[i], max_distance, generation, found[i]);
+        r.insert(r.end(), found[i].begin(), found[i].end());
+    }
+
+    add_stats(stats, NULL);
+    return true;
+}
+
+
+/** Look up a batch of queries, sharing the fetches of their probe
+ * keys.  results must already hold a list for each query.
+ */
+void HmSearchBase::find_batch_matches(const std::vector<hash_string>& queries,
+                                      int max_distance,
+                                      std::vector<LookupResultList>& results,
+                                      LookupStats& stats)
+{
+    int klen = key_length();
+    ProbeKeys probes;
+    std::vector<size_t> first_probe(queries.size() + 1);
+
+    probes.keys.reserve(queries.size() * probes_per_query() * klen);
+    probes.matches.reserve(queries.size() * probes_per_query());
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        first_probe[q] = probes.matches.size();
+        get_probe_keys(queries[q], 0, _partitions, probes);
+    }
+    first_probe[queries.size()] = probes.matches.size();
+
+    // Fetch each distinct key once, in key order, remembering which
+    // fetched posting list (if any) each probe refers to
+    std::vector<size_t> order(probes.matches.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), ProbeKeyLess(&probes.keys[0], klen));
+
+    PostingBuffers* buffers = acquire_buffers();
+    PostingLists fetched;
+    std::vector<int> posting(order.size(), -1);
+
+    std::vector<uint8_t> keys;
+    std::vector<size_t> first_order;
+
+    for (size_t i = 0; i < order.size(); ) {
+        const uint8_t* key = &probes.keys[order[i] * klen];
+
+        first_order.push_back(i);
+        keys.insert(keys.end(), key, key + klen);
+
+        i++;
+        while (i < order.size()
+               && memcmp(&probes.keys[order[i] * klen], key, klen) == 0) {
+            i++;
+        }
+    }
+    first_order.push_back(order.size());
+
+    size_t count = first_order.size() - 1;
+    std::vector<const uint8_t*> hashes(count);
+    std::vector<size_t> lengths(count);
+
+    if (buffers->size() < count) {
+        buffers->resize(count);
+    }
+
+    if (count > 0) {
+        get_posting_lists(&keys[0], count, &(*buffers)[0], &hashes[0], &lengths[0]);
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        if (hashes[k]) {
+            fetched.push_back(PostingList(0, hashes[k], lengths[k]));
+            for (size_t i = first_order[k]; i < first_order[k + 1]; i++) {
+                posting[order[i]] = fetched.size() - 1;
+            }
+        }
+    }
+
+    // Fan the posting lists back out to the queries
+    CandidateTable candidates(_entry_bytes);
+    PostingLists postings;
+
+    // Each query is counted as if looked up on its own, even though
+    // the posting lists are only fetched once
+    stats.probes += probes.matches.size();
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        postings.clear();
+        for (size_t p = first_probe[q]; p < first_probe[q + 1]; p++) {
+            if (posting[p] >= 0) {
+                const PostingList& f = fetched[posting[p]];
+                postings.push_back(PostingList(probes.matches[p], f.hashes, f.length));
+            }
+        }
+
+        count_candidates(postings, candidates);
+        count_postings(postings, stats);
+        stats.candidates += candidates.count();
+
+        ResultCollector collector(results[q], _hash_bytes);
+        results[q].reserve(results[q].size() + count_valid_candidates(candidates));
+        verify_candidates(queries[q], candidates, max_distance, collector, stats);
+    }
+
+    release_buffers(buffers);
+}
+
+
+HmSearchBase::~HmSearchBase()
+{
+    delete _prewarmer;
+    set_lookup_threads(0);
+    set_result_cache(0);
+
+    for (size_t i = 0; i < _free_buffers.size(); i++) {
+        delete _free_buffers[i];
+    }
+}
+
+
+HmSearchBase::PostingBuffers* HmSearchBase::acquire_buffers()
+{
+    kyotocabinet::ScopedSpinLock lock(&_buffers_lock);
+
+    if (_free_buffers.empty()) {
+        return new PostingBuffers();
+    }
+
+    PostingBuffers* buffers = _free_buffers.back();
+    _free_buffers.pop_back();
+    return buffers;
+}
+
+
+void HmSearchBase::release_buffers(PostingBuffers* buffers)
+{
+    // Don't hang on to the buffers of lookups that hit unusually
+    // large posting lists
+    size_t capacity = 0;
+    for (PostingBuffers::const_iterator i = buffers->begin(); i != buffers->end(); ++i) {
+        capacity += i->capacity();
+    }
+
+    if (capacity > MAX_POOLED_BUFFER_BYTES) {
+        delete buffers;
+        return;
+    }
+
+    kyotocabinet::ScopedSpinLock lock(&_buffers_lock);
+    _free_buffers.push_back(buffers);
+}
+
+
+bool HmSearchBase::lookup_nearest(const hash_string& query,
+                                  size_t k,
+                                  LookupResultList& result,
+                                  int reduced_error,
+                                  std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != (size_t) _hash_bytes) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!is_open()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (k == 0) {
+        return true;
+    }
+
+    int max_distance = effective_max_error(reduced_error);
+    ProbeKeys probes;
+    get_probe_keys(query, 0, _partitions, probes);
+
+    PostingBuffers* buffers = acquire_buffers();
+    if (buffers->size() < probes.matches.size()) {
+        buffers->resize(probes.matches.size());
+    }
+
+    PostingLists postings;
+    CandidateTable candidates(_entry_bytes);
+    NearestMatches nearest(k);
+    LookupStats stats;
+
+    // Any hash not found by the exact-match probes differs in every
+    // partition, so it is at least _partitions away.  Then the
+    // 1-variant probes are only needed if the matches found so far
+    // could be beaten by such a hash.
+    fetch_posting_lists(probes, 0, *buffers, postings);
+    count_candidates(postings, candidates);
+    verify_nearest(query, candidates, max_distance, false, nearest);
+
+    if (max_distance >= _partitions
+        && !(nearest.full() && nearest.worst() <= _partitions)) {
+        fetch_posting_lists(probes, 1, *buffers, postings);
+        count_candidates(postings, candidates);
+        verify_nearest(query, candidates, max_distance, true, nearest);
+
+        stats.probes += probes.matches.size();
+    }
+    else {
+        stats.probes += _partitions;
+    }
+
+    size_t start = result.size();
+    nearest.get(result);
+    release_buffers(buffers);
+
+    stats.lookups = 1;
+    stats.candidates = candidates.count();
+    stats.matches = result.size() - start;
+    count_postings(postings, stats);
+    add_stats(stats, NULL);
+
+    return true;
+}
+
+
+void HmSearchBase::set_lookup_threads(int threads)
+{
+    if (_lookup_queue) {
+        _lookup_queue->finish();
+        delete _lookup_queue;
+        _lookup_queue = NULL;
+    }
+
+    if (threads > 0) {
+        _lookup_queue = new LookupQueue();
+        _lookup_queue->start(threads);
+    }
+}
+
+
+void HmSearchBase::set_result_cache(size_t max_bytes)
+{
+    delete _cache;
+    _cache = NULL;
+
+    if (max_bytes > 0) {
+        _cache = new ResultCache(max_bytes, _hash_bytes);
+    }
+}
+
+
+HmSearch::LookupStats HmSearchBase::get_lookup_stats()
+{
+    kyotocabinet::ScopedSpinLock lock(&_stats_lock);
+    return _stats;
+}
+
+
+void HmSearchBase::reset_lookup_stats()
+{
+    kyotocabinet::ScopedSpinLock lock(&_stats_lock);
+    _stats = LookupStats();
+}
+
+
+/** Add the counters of a lookup to the totals, and to the counters
+ * provided by the caller, if any.
+ */
+void HmSearchBase::add_stats(const LookupStats& stats, LookupStats* caller_stats)
+{
+    if (caller_stats) {
+        caller_stats->add(stats);
+    }
+
+    kyotocabinet::ScopedSpinLock lock(&_stats_lock);
+    _stats.add(stats);
+}
+
+
+HmSearch::CacheStats HmSearchBase::get_cache_stats()
+{
+    if (!_cache) {
+        return CacheStats();
+    }
+
+    return _cache->get_stats();
+}
+
+
+void HmSearchBase::LookupQueue::do_task(Task* task)
+{
+    PartitionTask* pt = static_cast<PartitionTask*>(task);
+
+    pt->db->get_candidates(*pt->query, pt->partition, pt->partition + 1,
+                           *pt->buffers, pt->candidates, pt->stats);
+    pt->latch->count_down();
+}
+
+
+void HmSearchBase::get_probe_keys(const hash_string& query,
+                                  int first_partition, int end_partition,
+                                  ProbeKeys& probes)
+{
+    uint8_t permuted[_hash_bytes];
+    const uint8_t* phash = partition_hash(query.data(), permuted);
+
+    if (_probe_keys) {
+        _probe_keys(phash, first_partition, end_partition, probes);
+        return;
+    }
+
+    int klen = key_length();
+    uint8_t key[klen];
+
+    for (int i = first_partition; i < end_partition; i++) {
+        int bits = get_partition_key(phash, i, key);
+
+        // Exact match
+        probes.keys.insert(probes.keys.end(), key, key + klen);
+        probes.matches.push_back(0);
+
+        // 1-variant matches
 
         int pbyte = (i * _partition_bits) / 8;
         for (int pbit = i * _partition_bits; bits > 0; pbit++, bits--) {
             uint8_t flip = 1 << (7 - (pbit % 8));
 
-            key[pbit / 8 - pbyte + 2] ^= flip;
-            
-            if (_db->get(std::string((const char*) key, _partition_bytes + 2), &hashes)) {
-                add_hash_candidates(candidates, 1, (const uint8_t*)hashes.data(), hashes.length());
-            }
-            
-            key[pbit / 8 - pbyte + 2] ^= flip;
+            key[pbit / 8 - pbyte + 2] ^= flip;
+
+            probes.keys.insert(probes.keys.end(), key, key + klen);
+            probes.matches.push_back(1);
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+        }
+    }
+}
+
+
+void HmSearchBase::get_candidates(
+    const hash_string& query,
+    int first_partition, int end_partition,
+    PostingBuffers& buffers,
+    CandidateTable& candidates,
+    LookupStats& stats)
+{
+    int klen = key_length();
+    int probe_count = (end_partition - first_partition) * (_partition_bits + 1);
+    ProbeKeys probes;
+
+    probes.keys.reserve(probe_count * klen);
+    probes.matches.reserve(probe_count);
+    get_probe_keys(query, first_partition, end_partition, probes);
+
+    // Fetch all posting lists first, so the candidate table can be
+    // sized from their total length
+    size_t count = probes.matches.size();
+    PostingLists postings;
+
+    if (buffers.size() < count) {
+        buffers.resize(count);
+    }
+
+    std::vector<const uint8_t*> hashes(count);
+    std::vector<size_t> lengths(count);
+
+    if (count > 0) {
+        get_posting_lists(&probes.keys[0], count, &buffers[0], &hashes[0], &lengths[0]);
+    }
+
+    for (size_t p = 0; p < count; p++) {
+        if (hashes[p]) {
+            postings.push_back(PostingList(probes.matches[p], hashes[p], lengths[p]));
+        }
+    }
+
+    count_candidates(postings, candidates);
+    count_postings(postings, stats);
+
+    stats.probes += count;
+    stats.candidates += candidates.count();
+}
+
+
+void HmSearchBase::get_posting_lists(const uint8_t* keys, size_t count,
+                                     std::string* buffers,
+                                     const uint8_t** hashes, size_t* lengths)
+{
+    int klen = key_length();
+
+    for (size_t i = 0; i < count; i++) {
+        if (!get_posting_list(keys + i * klen, buffers[i], &hashes[i], &lengths[i])) {
+            hashes[i] = NULL;
+        }
+    }
+}
+
+
+void HmSearchBase::fetch_posting_lists(const ProbeKeys& probes, int match,
+                                       PostingBuffers& buffers,
+                                       PostingLists& postings)
+{
+    int klen = key_length();
+    std::vector<uint8_t> keys;
+    size_t first_buffer = 0;
+
+    // The probes of earlier stages keep their buffers
+    for (size_t p = 0; p < probes.matches.size(); p++) {
+        if (probes.matches[p] < match) {
+            first_buffer++;
+        }
+        else if (probes.matches[p] == match) {
+            keys.insert(keys.end(), &probes.keys[p * klen], &probes.keys[(p + 1) * klen]);
+        }
+    }
+
+    size_t count = keys.size() / klen;
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<const uint8_t*> hashes(count);
+    std::vector<size_t> lengths(count);
+
+    get_posting_lists(&keys[0], count, &buffers[first_buffer], &hashes[0], &lengths[0]);
+
+    for (size_t i = 0; i < count; i++) {
+        if (hashes[i]) {
+            postings.push_back(PostingList(match, hashes[i], lengths[i]));
+        }
+    }
+}
+
+
+void HmSearchBase::verify_nearest(const hash_string& query,
+                                  const CandidateTable& candidates,
+                                  int max_distance, bool all_probed,
+                                  NearestMatches& nearest)
+{
+    // A lower bound on the distance of each candidate: every
+    // partition without an exact match differs in at least one bit,
+    // or at least two bits once all probes have been made and the
+    // partition didn't even have a 1-variant match either
+    std::vector<std::pair<int, const uint8_t*> > order;
+
+    for (CandidateTable::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+        if (!i->hash) {
+            continue;
+        }
+
+        const Candidate& c = i->candidate;
+        int bound = _partitions - c.exact_matches;
+        if (all_probed) {
+            bound = 2 * _partitions - 2 * c.exact_matches - (c.matches - c.exact_matches);
+        }
+
+        if (bound <= max_distance) {
+            order.push_back(std::make_pair(bound, i->hash));
+        }
+    }
+
+    std::sort(order.begin(), order.end());
+
+    std::string buffer;
+
+    for (size_t i = 0; i < order.size(); i++) {
+        int limit = max_distance;
+        if (nearest.full()) {
+            if (order[i].first >= nearest.worst()) {
+                break;
+            }
+            limit = nearest.worst() - 1;
+        }
+
+        const uint8_t* hash = order[i].second;
+        if (_id_bytes && !get_hash(order[i].second, buffer, &hash)) {
+            continue;
+        }
+
+        int distance = hamming_distance(query.data(), hash, limit);
+        if (distance <= limit) {
+            nearest.add(hash_string(hash, _hash_bytes), distance);
+        }
+    }
+}
+
+
+void HmSearchBase::get_candidates_parallel(
+    const hash_string& query,
+    std::vector<PartitionTask*>& tasks,
+    CandidateTable& candidates,
+    LookupStats& stats)
+{
+    // The calling thread takes the first partition itself
+    LookupLatch latch(_partitions - 1);
+
+    tasks.reserve(_partitions);
+    for (int i = 0; i < _partitions; i++) {
+        tasks.push_back(new PartitionTask(this, &query, i, &latch));
+    }
+
+    for (int i = 1; i < _partitions; i++) {
+        _lookup_queue->add_task(tasks[i]);
+    }
+
+    get_candidates(query, 0, 1, *tasks[0]->buffers, tasks[0]->candidates,
+                   tasks[0]->stats);
+    latch.wait();
+
+    // The per-partition tables point into the task buffers, so the
+    // merged table stays valid as long as the tasks are kept
+    size_t total = 0;
+    for (int i = 0; i < _partitions; i++) {
+        total += tasks[i]->candidates.count();
+    }
+
+    candidates.reset(total);
+
+    for (int i = 0; i < _partitions; i++) {
+        merge_candidates(candidates, tasks[i]->candidates);
+
+        stats.probes += tasks[i]->stats.probes;
+        stats.probe_hits += tasks[i]->stats.probe_hits;
+        stats.posting_bytes += tasks[i]->stats.posting_bytes;
+    }
+
+    // A hash is only one candidate even if several partitions found it
+    stats.candidates += candidates.count();
+}
+
+
+void HmSearchBase::count_postings(const PostingLists& postings, LookupStats& stats)
+{
+    stats.probe_hits += postings.size();
+
+    for (PostingLists::const_iterator p = postings.begin(); p != postings.end(); ++p) {
+        stats.posting_bytes += p->length;
+    }
+}
+
+
+void HmSearchBase::count_candidates(const PostingLists& postings,
+                                    CandidateTable& candidates)
+{
+    size_t total = 0;
+    for (PostingLists::const_iterator p = postings.begin(); p != postings.end(); ++p) {
+        total += p->length / _entry_bytes;
+    }
+
+    candidates.reset(total);
+
+    for (PostingLists::const_iterator p = postings.begin(); p != postings.end(); ++p) {
+        add_hash_candidates(candidates, p->match, p->hashes, p->length);
+    }
+}
+
+
+void HmSearchBase::add_hash_candidates(
+    CandidateTable& candidates, int match,
+    const uint8_t* entries, size_t length)
+{
+    int exact = (match == 0);
+
+    for (size_t n = 0; n + _entry_bytes <= length; n += _entry_bytes) {
+        Candidate& cand = candidates.get(entries + n);
+
+        ++cand.matches;
+        cand.exact_matches += exact;
+        if (cand.matches == 1) {
+            cand.first_match = match;
+        }
+        else if (cand.matches == 2) {
+            cand.second_match = match;
+        }
+    }
+}
+
+
+void HmSearchBase::merge_candidates(CandidateTable& candidates,
+                                   const CandidateTable& partial)
+{
+    for (CandidateTable::const_iterator i = partial.begin(); i != partial.end(); ++i) {
+        if (!i->hash) {
+            continue;
+        }
+
+        // Only the first two matches are looked at by valid_candidate(),
+        // so replay those and just count the rest
+        Candidate& cand = candidates.get(i->hash);
+        const Candidate& p = i->candidate;
+
+        cand.exact_matches += p.exact_matches;
+
+        for (int m = 0; m < p.matches; m++) {
+            int match = (m == 0 ? p.first_match : p.second_match);
+
+            ++cand.matches;
+            if (cand.matches == 1) {
+                cand.first_match = match;
+            }
+            else if (cand.matches == 2) {
+                cand.second_match = match;
+            }
+            else {
+                cand.matches += p.matches - m - 1;
+                break;
+            }
+        }
+    }
+}
+
+
+size_t HmSearchBase::count_valid_candidates(const CandidateTable& candidates)
+{
+    size_t count = 0;
+
+    for (CandidateTable::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+        if (i->hash && valid_candidate(i->candidate)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+void HmSearchBase::verify_candidates(const hash_string& query,
+                                     const CandidateTable& candidates,
+                                     int max_distance,
+                                     LookupCallback& callback,
+                                     LookupStats& stats)
+{
+    std::string buffer;
+    std::set<hash_string> found;
+
+    for (CandidateTable::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+        if (!i->hash) {
+            continue;
+        }
+
+        if (!valid_candidate(i->candidate)) {
+            stats.filtered++;
+            continue;
+        }
+
+        const uint8_t* hash = i->hash;
+
+        // Only the IDs of valid candidates are resolved
+        if (_id_bytes && !get_hash(i->hash, buffer, &hash)) {
+            continue;
+        }
+
+        int distance = hamming_distance(query.data(), hash, max_distance);
+
+        if (distance > max_distance) {
+            stats.false_positives++;
+            continue;
+        }
+
+        // A hash inserted more than once in a compact database
+        // has several IDs, but should still only be found once
+        if (_id_bytes && !found.insert(hash_string(hash, _hash_bytes)).second) {
+            continue;
+        }
+
+        stats.matches++;
+        if (!callback.match(hash, distance)) {
+            return;
+        }
+    }
+}
+
+
+bool HmSearchBase::valid_candidate(const Candidate& candidate)
+{
+    if (_max_error & 1) {
+        // Odd k
+        if (candidate.matches < 3) {
+            if (candidate.matches == 1 || (candidate.first_match && candidate.second_match)) {
+                return false;
+            }
+        }
+    }
+    else {
+        // Even k
+        if (candidate.matches < 2) {
+            if (candidate.first_match)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+void PartitionLayout::set_permutation(const std::vector<uint16_t>& permutation)
+{
+    _permutation = permutation;
+    _permute_table.clear();
+
+    if (permutation.empty()) {
+        return;
+    }
+
+    _permute_table.resize(_hash_bytes * 256 * _permute_words);
+
+    for (int i = 0; i < _hash_bytes; i++) {
+        for (int value = 0; value < 256; value++) {
+            uint8_t permuted[_permute_words * 8];
+            memset(permuted, 0, sizeof(permuted));
+
+            for (int out = 0; out < _hash_bits; out++) {
+                int in = permutation[out];
+                if (in / 8 == i && (value & (0x80 >> (in % 8)))) {
+                    permuted[out / 8] |= 0x80 >> (out % 8);
+                }
+            }
+
+            memcpy(&_permute_table[(i * 256 + value) * _permute_words],
+                   permuted, sizeof(permuted));
+        }
+    }
+}
+
+
+static double bit_entropy(double p)
+{
+    if (p <= 0 || p >= 1) {
+        return 0;
+    }
+    return -p * log2(p) - (1 - p) * log2(1 - p);
+}
+
+/** Mutual information between two bits, from the number of samples
+ * n, the number of ones in each bit, and the number of samples where
+ * both are one.
+ */
+static double mutual_information(double n, double ones_a, double ones_b, double both)
+{
+    double cells[4] = {
+        n - ones_a - ones_b + both, ones_b - both,
+        ones_a - both, both
+    };
+    double info = 0;
+
+    for (int a = 0; a < 2; a++) {
+        for (int b = 0; b < 2; b++) {
+            double c = cells[a * 2 + b];
+            double row = a ? ones_a : n - ones_a;
+            double col = b ? ones_b : n - ones_b;
+
+            if (c > 0) {
+                info += (c / n) * log2(c * n / (row * col));
+            }
+        }
+    }
+
+    return info;
+}
+
+struct EntropyGreater {
+    EntropyGreater(const std::vector<double>& e) : entropy(e) {}
+
+    bool operator()(unsigned a, unsigned b) const {
+        return entropy[a] > entropy[b] || (entropy[a] == entropy[b] && a < b);
+    }
+
+    const std::vector<double>& entropy;
+};
+
+
+void choose_permutation(unsigned hash_bits, unsigned max_error,
+                        const std::vector<HmSearch::hash_string>& sample,
+                        std::vector<uint16_t>& permutation)
+{
+    int partitions = (max_error + 3) / 2;
+    int partition_bits = ceil((double)hash_bits / partitions);
+    size_t n = sample.size();
+    size_t words = (n + 63) / 64;
+
+    // Store each bit of the sample as a bitmap over the samples, so
+    // the samples where two bits are both one can be counted quickly
+    std::vector<uint64_t> columns(hash_bits * words);
+    std::vector<double> ones(hash_bits);
+
+    for (size_t i = 0; i < n; i++) {
+        for (unsigned bit = 0; bit < hash_bits; bit++) {
+            if (sample[i][bit / 8] & (0x80 >> (bit % 8))) {
+                columns[bit * words + i / 64] |= uint64_t(1) << (i % 64);
+                ones[bit]++;
+            }
+        }
+    }
+
+    std::vector<double> entropy(hash_bits);
+    for (unsigned bit = 0; bit < hash_bits; bit++) {
+        entropy[bit] = bit_entropy(ones[bit] / n);
+    }
+
+    std::vector<double> info(hash_bits * hash_bits);
+    for (unsigned a = 0; a < hash_bits; a++) {
+        for (unsigned b = a + 1; b < hash_bits; b++) {
+            uint64_t both = 0;
+            for (size_t w = 0; w < words; w++) {
+                both += __builtin_popcountll(columns[a * words + w] & columns[b * words + w]);
+            }
+
+            info[a * hash_bits + b] = info[b * hash_bits + a] =
+                mutual_information(n, ones[a], ones[b], both);
+        }
+    }
+
+    // Place the bits greedily, most informative first.  Each bit goes
+    // where it adds the most entropy (its own, less what it shares
+    // with the bits already there) relative to what the partition
+    // already has, which keeps both biased and correlated bits apart.
+    std::vector<unsigned> order(hash_bits);
+    for (unsigned bit = 0; bit < hash_bits; bit++) {
+        order[bit] = bit;
+    }
+    std::sort(order.begin(), order.end(), EntropyGreater(entropy));
+
+    std::vector<std::vector<unsigned> > members(partitions);
+    std::vector<double> total(partitions);
+
+    for (unsigned i = 0; i < hash_bits; i++) {
+        unsigned bit = order[i];
+        int best = -1;
+        double best_gain = 0;
+
+        for (int p = 0; p < partitions; p++) {
+            int size = std::max(0, std::min(partition_bits,
+                                            (int) hash_bits - p * partition_bits));
+            if ((int) members[p].size() >= size) {
+                continue;
+            }
+
+            double gain = entropy[bit];
+            for (size_t j = 0; j < members[p].size(); j++) {
+                gain -= info[bit * hash_bits + members[p][j]];
+            }
+            gain = std::max(gain, 0.0);
+
+            if (best < 0 || gain - total[p] > best_gain - total[best]) {
+                best = p;
+                best_gain = gain;
+            }
+        }
+
+        members[best].push_back(bit);
+        total[best] += best_gain;
+    }
+
+    permutation.clear();
+    for (int p = 0; p < partitions; p++) {
+        permutation.insert(permutation.end(), members[p].begin(), members[p].end());
+    }
+}
+
+
+int PartitionLayout::get_partition_key(const uint8_t* hash, int partition, uint8_t *key) const
+{
+    int psize, hash_bit, bits_left;
+
+    psize = _hash_bits - partition * _partition_bits;
+    if (psize > _partition_bits) {
+        psize = _partition_bits;
+    }
+
+    // Store key identifier and partition number first
+    key[0] = 'P';
+    key[1] = partition;
+
+    // Copy bytes, masking out some bits at the start and end
+    bits_left = psize;
+    hash_bit = partition * _partition_bits;
+
+    for (int i = 0; i < _partition_bytes; i++) {
+        // Pad the rest of the key without reading past the hash,
+        // which may end here
+        if (bits_left == 0) {
+            key[i + 2] = 0;
+            continue;
+        }
+
+        int byte = hash_bit / 8;
+        int bit = hash_bit % 8;
+        int bits = 8 - bit;
+
+        if (bits > bits_left) {
+            bits = bits_left;
+        }
+
+        bits_left -= bits;
+        hash_bit += bits;
+
+        key[i + 2] = hash[byte] & (((1 << bits) - 1) << (8 - bit - bits));
+    }
+
+    return psize;
+}
+
+
+HmSearchBuilder::~HmSearchBuilder()
+{
+    for (size_t i = 0; i < _spills.size(); i++) {
+        fclose(_spills[i]);
+    }
+}
+
+
+bool HmSearchBuilder::add(const HmSearch::hash_string& hash,
+                          std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != (size_t) _hash_bytes) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_finished) {
+        *error_msg = "database already built";
+        return false;
+    }
+
+    int klen = key_length();
+
+    // Allocate the whole budget once, since letting the vectors grow
+    // could take up to twice the memory limit.  spill_buffer() keeps
+    // the capacity.
+    if (_order.capacity() < _max_records) {
+        _buffer.reserve(_max_records * _record_bytes);
+        _order.reserve(_max_records);
+    }
+
+    for (int i = 0; i < _partitions; i++) {
+        if (buffer_full() && !spill_buffer(error_msg)) {
+            return false;
         }
+
+        size_t offset = _buffer.size();
+        _buffer.resize(offset + _record_bytes);
+        get_partition_key(hash.data(), i, &_buffer[offset]);
+        memcpy(&_buffer[offset + klen], hash.data(), _hash_bytes);
+
+        _order.push_back(_order.size());
     }
+
+    return true;
 }
 
 
-void HmSearchImpl::add_hash_candidates(
-    HmSearchImpl::CandidateMap& candidates, int match,
-    const uint8_t* hashes, size_t length)
+bool HmSearchBuilder::finish(std::string* error_msg)
 {
-    for (size_t n = 0; n < length; n += _hash_bytes) {
-        hash_string hash = hash_string(hashes + n, _hash_bytes);
-        Candidate& cand = candidates[hash];
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
 
-        ++cand.matches;
-        if (cand.matches == 1) {
-            cand.first_match = match;
+    if (_finished) {
+        *error_msg = "database already built";
+        return false;
+    }
+    _finished = true;
+
+    // Keep the last run in memory if nothing has been spilled,
+    // otherwise merge everything from the spill files
+    if (_spills.empty()) {
+        sort_buffer();
+    }
+    else if (!_order.empty() && !spill_buffer(error_msg)) {
+        return false;
+    }
+
+    uint64_t keys = 0;
+    if (!merge_runs(NULL, &keys, error_msg)) {
+        return false;
+    }
+
+    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
+    if (!db.get()) {
+        *error_msg = "out of memory";
+        return false;
+    }
+
+    tune_database(db.get(), keys);
+
+    if (!create_database(db.get(), _path, _hash_bits, _max_error, 0, ChunkFormat(),
+                         std::vector<uint16_t>(), error_msg)) {
+        return false;
+    }
+
+    if (!merge_runs(db.get(), &keys, error_msg)) {
+        return false;
+    }
+
+    if (!db->close()) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    return true;
+}
+
+
+void HmSearchBuilder::sort_buffer()
+{
+    if (_order.empty()) {
+        return;
+    }
+
+    std::sort(_order.begin(), _order.end(), RecordLess(&_buffer[0], _record_bytes));
+}
+
+
+bool HmSearchBuilder::spill_buffer(std::string* error_msg)
+{
+    sort_buffer();
+
+    std::string name = _path + ".sortXXXXXX";
+    std::vector<char> tmpl(name.begin(), name.end());
+    tmpl.push_back('\0');
+
+    int fd = mkstemp(&tmpl[0]);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    // The spill file is only reachable through the descriptor, so it
+    // disappears on its own when closed
+    unlink(&tmpl[0]);
+
+    FILE* f = fdopen(fd, "w+b");
+    if (!f) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    _spills.push_back(f);
+
+    for (size_t i = 0; i < _order.size(); i++) {
+        if (fwrite(&_buffer[_order[i] * _record_bytes], _record_bytes, 1, f) != 1) {
+            *error_msg = strerror(errno);
+            return false;
         }
-        else if (cand.matches == 2) {
-            cand.second_match = match;
+    }
+
+    if (fflush(f) != 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    _buffer.clear();
+    _order.clear();
+    return true;
+}
+
+
+bool HmSearchBuilder::next_record(Run& run, std::string* error_msg)
+{
+    if (!run.file) {
+        if (run.pos >= _order.size()) {
+            run.record.clear();
+            return true;
+        }
+
+        const uint8_t* r = &_buffer[_order[run.pos++] * _record_bytes];
+        run.record.assign(r, r + _record_bytes);
+        return true;
+    }
+
+    run.record.resize(_record_bytes);
+    if (fread(&run.record[0], _record_bytes, 1, run.file) != 1) {
+        if (ferror(run.file)) {
+            *error_msg = strerror(errno);
+            return false;
         }
+        run.record.clear();
     }
+
+    return true;
 }
 
 
-bool HmSearchImpl::valid_candidate(
-    const HmSearchImpl::Candidate& candidate)
+bool HmSearchBuilder::merge_runs(kyotocabinet::HashDB* db, uint64_t* keys,
+                                 std::string* error_msg)
 {
-    if (_max_error & 1) {
-        // Odd k
-        if (candidate.matches < 3) {
-            if (candidate.matches == 1 || (candidate.first_match && candidate.second_match)) {
-                return false;
-            }
+    int klen = key_length();
+
+    std::vector<Run> runs(_spills.empty() ? 1 : _spills.size());
+    std::priority_queue<size_t, std::vector<size_t>, RunGreater> queue(
+        RunGreater(&runs, _record_bytes));
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        runs[i].file = _spills.empty() ? NULL : _spills[i];
+        runs[i].pos = 0;
+
+        if (runs[i].file && fseeko(runs[i].file, 0, SEEK_SET) != 0) {
+            *error_msg = strerror(errno);
+            return false;
+        }
+
+        if (!next_record(runs[i], error_msg)) {
+            return false;
+        }
+
+        if (!runs[i].record.empty()) {
+            queue.push(i);
         }
     }
-    else {
-        // Even k
-        if (candidate.matches < 2) {
-            if (candidate.first_match)
+
+    std::string key, hashes;
+    *keys = 0;
+
+    while (!queue.empty()) {
+        size_t i = queue.top();
+        queue.pop();
+
+        const char* r = (const char*) &runs[i].record[0];
+
+        if (key.compare(0, std::string::npos, r, klen) != 0) {
+            if (db && !key.empty() && !db->set(key, hashes)) {
+                *error_msg = db->error().message();
                 return false;
+            }
+
+            key.assign(r, klen);
+            hashes.clear();
+            ++*keys;
+        }
+
+        // Records are sorted on the hash too, so duplicates are
+        // adjacent and only need to be stored once
+        if (hashes.empty()
+            || hashes.compare(hashes.length() - _hash_bytes, _hash_bytes,
+                              r + klen, _hash_bytes) != 0) {
+            hashes.append(r + klen, _hash_bytes);
         }
+
+        if (!next_record(runs[i], error_msg)) {
+            return false;
+        }
+
+        if (!runs[i].record.empty()) {
+            queue.push(i);
+        }
+    }
+
+    if (db && !key.empty() && !db->set(key, hashes)) {
+        *error_msg = db->error().message();
+        return false;
     }
 
     return true;
 }
 
 
-int HmSearchImpl::hamming_distance(
-    const HmSearchImpl::hash_string& query,
-    const HmSearchImpl::hash_string& hash)
+/* Specialised probe key generators
+ *
+ * For the most common hash sizes and max errors the partition layout
+ * is fixed at compile time.  Each partition key then fits in a 64-bit
+ * word loaded straight from the hash, which is masked to the
+ * partition bits, and each 1-variant key is that word with one more
+ * bit flipped.  The masks are kept in memory byte order, so the keys
+ * are exactly those of get_partition_key() on any machine.
+ */
+
+template <int HashBits, int MaxError>
+struct FixedLayout
+{
+    enum {
+        hash_bytes = HashBits / 8,
+        partitions = (MaxError + 3) / 2,
+        partition_bits = (HashBits + partitions - 1) / partitions,
+        partition_bytes = (partition_bits + 7) / 8 + 1,
+        key_length = partition_bytes + 2
+    };
+
+    // The key bytes of a partition must fit in one word
+    typedef char partition_fits_word[partition_bytes <= 8 ? 1 : -1];
+
+    FixedLayout() {
+        for (int p = 0; p < partitions; p++) {
+            int start = p * partition_bits;
+
+            bits[p] = std::min(int(partition_bits), HashBits - start);
+            first_byte[p] = start / 8;
+
+            uint8_t m[8] = { 0 };
+            for (int b = start; b < start + bits[p]; b++) {
+                m[b / 8 - first_byte[p]] |= 1 << (7 - b % 8);
+            }
+            memcpy(&mask[p], m, sizeof(m));
+
+            for (int j = 0; j < bits[p]; j++) {
+                uint8_t f[8] = { 0 };
+                int b = start + j;
+                f[b / 8 - first_byte[p]] = 1 << (7 - b % 8);
+                memcpy(&flip[p][j], f, sizeof(f));
+            }
+        }
+    }
+
+    int bits[partitions];
+    int first_byte[partitions];
+    uint64_t mask[partitions];
+    uint64_t flip[partitions][partition_bits];
+};
+
+
+template <int HashBits, int MaxError>
+void HmSearchBase::get_fixed_probe_keys(const uint8_t* hash,
+                                        int first_partition, int end_partition,
+                                        ProbeKeys& probes)
+{
+    typedef FixedLayout<HashBits, MaxError> Layout;
+    static const Layout layout;
+
+    // Pad the hash so the word of the last partition can be loaded
+    uint8_t padded[Layout::hash_bytes + 8] = { 0 };
+    memcpy(padded, hash, Layout::hash_bytes);
+
+    size_t count = 0;
+    for (int p = first_partition; p < end_partition; p++) {
+        count += layout.bits[p] + 1;
+    }
+
+    size_t old_count = probes.matches.size();
+    probes.keys.resize((old_count + count) * Layout::key_length);
+    probes.matches.resize(old_count + count, 1);
+
+    uint8_t* key = &probes.keys[old_count * Layout::key_length];
+    uint8_t* match = &probes.matches[old_count];
+
+    for (int p = first_partition; p < end_partition; p++) {
+        uint64_t word = load_word(padded + layout.first_byte[p]) & layout.mask[p];
+        const uint64_t* flip = layout.flip[p];
+
+        // Exact match
+        key[0] = 'P';
+        key[1] = p;
+        memcpy(key + 2, &word, Layout::partition_bytes);
+        key += Layout::key_length;
+        *match = 0;
+        match += layout.bits[p] + 1;
+
+        // 1-variant matches
+        for (int j = 0; j < layout.bits[p]; j++) {
+            uint64_t variant = word ^ flip[j];
+            key[0] = 'P';
+            key[1] = p;
+            memcpy(key + 2, &variant, Layout::partition_bytes);
+            key += Layout::key_length;
+        }
+    }
+}
+
+
+HmSearchBase::ProbeKeyFunc HmSearchBase::select_probe_key_func(int hash_bits, int max_error)
+{
+    if (hash_bits == 64 && max_error == 6) {
+        return get_fixed_probe_keys<64, 6>;
+    }
+
+    if (hash_bits == 64 && max_error == 10) {
+        return get_fixed_probe_keys<64, 10>;
+    }
+
+    if (hash_bits == 256 && max_error == 10) {
+        return get_fixed_probe_keys<256, 10>;
+    }
+
+    return NULL;
+}
+
+
+/* Hamming distance kernels
+ *
+ * Hashes are compared 64 bits at a time (or a full vector at a time
+ * for the SIMD variants), checking after each step whether the
+ * running distance has passed the limit so that most non-matching
+ * candidates can be rejected after the first word or two.
+ *
+ * The best kernel supported by the CPU is chosen once when the
+ * database is opened.
+ */
+
+static inline int popcount_word(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static int distance_generic(const uint8_t* a, const uint8_t* b,
+                            int bytes, int max_distance)
 {
     int distance = 0;
+    int i = 0;
+
+    for (; i + 8 <= bytes; i += 8) {
+        distance += popcount_word(load_word(a + i) ^ load_word(b + i));
+        if (distance > max_distance) {
+            return distance;
+        }
+    }
 
-    for (size_t i = 0; i < query.length(); i++) {
-        distance += one_bits[query[i] ^ hash[i]];
+    if (i < bytes) {
+        distance += popcount_word(load_tail(a + i, bytes - i) ^ load_tail(b + i, bytes - i));
     }
 
     return distance;
 }
 
+// The kernels use 64-bit lane extracts and popcounts, which are only
+// available on x86_64
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HMSEARCH_X86_KERNELS 1
 
-int HmSearchImpl::get_partition_key(const hash_string& hash, int partition, uint8_t *key)
+__attribute__((target("popcnt")))
+static int distance_popcnt(const uint8_t* a, const uint8_t* b,
+                           int bytes, int max_distance)
 {
-    int psize, hash_bit, bits_left;
+    int distance = 0;
+    int i = 0;
 
-    psize = _hash_bits - partition * _partition_bits;
-    if (psize > _partition_bits) {
-        psize = _partition_bits;
+    for (; i + 8 <= bytes; i += 8) {
+        distance += __builtin_popcountll(load_word(a + i) ^ load_word(b + i));
+        if (distance > max_distance) {
+            return distance;
+        }
     }
 
-    // Store key identifier and partition number first
-    key[0] = 'P';
-    key[1] = partition;
+    if (i < bytes) {
+        distance += __builtin_popcountll(load_tail(a + i, bytes - i) ^ load_tail(b + i, bytes - i));
+    }
 
-    // Copy bytes, masking out some bits at the start and end
-    bits_left = psize;
-    hash_bit = partition * _partition_bits;
+    return distance;
+}
 
-    for (int i = 0; i < _partition_bytes; i++) {
-        int byte = hash_bit / 8;
-        int bit = hash_bit % 8;
-        int bits = 8 - bit;
+__attribute__((target("avx2,popcnt")))
+static int distance_avx2(const uint8_t* a, const uint8_t* b,
+                         int bytes, int max_distance)
+{
+    // Nibble lookup table popcount, summed per 64-bit lane with psadbw
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
 
-        if (bits > bits_left) {
-            bits = bits_left;
+    int distance = 0;
+    int i = 0;
+
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*) (a + i)),
+            _mm256_loadu_si256((const __m256i*) (b + i)));
+
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low_mask));
+        __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask));
+        __m256i sum = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+
+        distance += (_mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1)
+                     + _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3));
+        if (distance > max_distance) {
+            return distance;
         }
+    }
 
-        bits_left -= bits;
-        hash_bit += bits;
+    if (i < bytes) {
+        distance += distance_popcnt(a + i, b + i, bytes - i, max_distance - distance);
+    }
 
-        key[i + 2] = hash[byte] & (((1 << bits) - 1) << (8 - bit - bits));
+    return distance;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static int distance_avx512(const uint8_t* a, const uint8_t* b,
+                           int bytes, int max_distance)
+{
+    int distance = 0;
+    int i = 0;
+
+    for (; i + 64 <= bytes; i += 64) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                     _mm512_loadu_si512(b + i));
+
+        uint64_t counts[8];
+        _mm512_storeu_si512(counts, _mm512_popcnt_epi64(x));
+
+        distance += (counts[0] + counts[1] + counts[2] + counts[3]
+                     + counts[4] + counts[5] + counts[6] + counts[7]);
+        if (distance > max_distance) {
+            return distance;
+        }
     }
 
-    return psize;
+    if (i < bytes) {
+        distance += distance_popcnt(a + i, b + i, bytes - i, max_distance - distance);
+    }
+
+    return distance;
 }
 
+#endif // x86_64
 
-int HmSearchImpl::one_bits[256] = {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
-};
+
+HmSearchBase::DistanceFunc HmSearchBase::select_distance_func(int hash_bytes)
+{
+#ifdef HMSEARCH_X86_KERNELS
+    __builtin_cpu_init();
+
+    // The vector kernels only pay off when the hash fills at least
+    // one full vector.
+    if (hash_bytes >= 64 && __builtin_cpu_supports("avx512vpopcntdq")) {
+        return distance_avx512;
+    }
+
+    if (hash_bytes >= 32 && __builtin_cpu_supports("avx2")) {
+        return distance_avx2;
+    }
+
+    if (__builtin_cpu_supports("popcnt")) {
+        return distance_popcnt;
+    }
+#endif
+
+    return distance_generic;
+}
 
 /*
   Local Variables:
@@ -8,7 +8,7 @@
 #define __HMSEARCH_H_INCLUDED__
 
 #include <string>
-#include <list>
+#include <vector>
 #include <stdint.h>
 
 /** Interface to a HmSearch database.
@@ -48,13 +48,169 @@ public:
         int distance;
     };
 
-    typedef std::list<LookupResult> LookupResultList;
+    typedef std::vector<LookupResult> LookupResultList;
+
+    /** Interface for receiving the matches of a lookup one at a time,
+     * without collecting them in a LookupResultList.
+     */
+    class LookupCallback
+    {
+    public:
+        virtual ~LookupCallback() {}
+
+        /** Called for each hash found by the lookup, along with its
+         * hamming distance from the query hash.  The hash is
+         * hash_bits() / 8 raw bytes, and is only valid during the
+         * call.
+         *
+         * Return false to stop the lookup without looking for any
+         * more matches.
+         */
+        virtual bool match(const uint8_t* hash, int distance) = 0;
+    };
+
+    /** Counters describing the work done by lookups, see lookup().
+     */
+    struct LookupStats {
+        LookupStats()
+            : lookups(0), probes(0), probe_hits(0), posting_bytes(0)
+            , candidates(0), filtered(0), false_positives(0), matches(0)
+            { }
+
+        void add(const LookupStats& other) {
+            lookups += other.lookups;
+            probes += other.probes;
+            probe_hits += other.probe_hits;
+            posting_bytes += other.posting_bytes;
+            candidates += other.candidates;
+            filtered += other.filtered;
+            false_positives += other.false_positives;
+            matches += other.matches;
+        }
+
+        // Number of query hashes looked up
+        uint64_t lookups;
+
+        // Partition keys probed, and how many of them had a posting list
+        uint64_t probes;
+        uint64_t probe_hits;
+
+        // Total size of the posting lists scanned
+        uint64_t posting_bytes;
+
+        // Distinct hashes found in the posting lists
+        uint64_t candidates;
+
+        // Candidates rejected by their partition match counts, and
+        // those that passed but turned out to be too far away
+        uint64_t filtered;
+        uint64_t false_positives;
+
+        // Hashes passed on as matches
+        uint64_t matches;
+    };
+
+    /** Counters for the lookup result cache, see set_result_cache().
+     */
+    struct CacheStats {
+        CacheStats() : hits(0), misses(0), entries(0), bytes(0) {}
+
+        uint64_t hits;
+        uint64_t misses;
+
+        // Number of cached lookups, and the memory they use
+        uint64_t entries;
+        uint64_t bytes;
+    };
 
     /** Database open modes.
      */
     enum OpenMode {
         READONLY,
-        READWRITE
+        READWRITE,
+
+        /** Load the whole database into memory, closing the file
+         * again.  The loaded database is read-only.  A mapped
+         * database (see export_mapped()) is instead read into the
+         * page cache immediately.
+         */
+        MEMORY
+    };
+
+    /** How open() warms up the page cache, see OpenOptions.
+     */
+    enum Prewarm {
+        PREWARM_NONE,
+
+        /** Read the database file before open() returns. */
+        PREWARM_WAIT,
+
+        /** Read the database file on a background thread, while the
+         * database can already be used.  The thread is stopped when
+         * the database object is deleted.
+         */
+        PREWARM_BACKGROUND
+    };
+
+    /** Interface for receiving the progress of prewarming.
+     */
+    class PrewarmCallback
+    {
+    public:
+        virtual ~PrewarmCallback() {}
+
+        /** Called after each block of the database file at path has
+         * been read, with done == total when the whole file has been
+         * read.  With PREWARM_BACKGROUND this is called on the
+         * prewarming thread, and with sharded databases once for
+         * each shard file, possibly from several threads at once.
+         */
+        virtual void progress(const std::string& path,
+                              uint64_t done, uint64_t total) = 0;
+    };
+
+    /** Options for open().
+     */
+    struct OpenOptions {
+        OpenOptions()
+            : map_size(0), page_cache(0), prewarm(PREWARM_NONE), callback(NULL)
+            {}
+
+        /** Bytes of the database file that Kyoto Cabinet accesses
+         * through a memory map, or 0 for its default of 64 MB.
+         * Mapping at least the bucket array, which is about 6 bytes
+         * per partition key at the start of the file, avoids a
+         * system call for every probe.
+         */
+        uint64_t map_size;
+
+        /** Bytes of page cache for tree databases (.kct), or 0 for
+         * the Kyoto Cabinet default.  Hash databases have none.
+         */
+        uint64_t page_cache;
+
+        /** Read the whole database file into the OS page cache,
+         * from start to end, so lookups after a reboot don't have
+         * to wait for random reads.  In Kyoto Cabinet hash databases
+         * the bucket array comes first, followed by the records.
+         * This is ignored in MEMORY mode, which reads everything
+         * anyway.
+         */
+        Prewarm prewarm;
+
+        /** If provided, receives the progress of prewarming. */
+        PrewarmCallback* callback;
+    };
+
+    /** Flags for creating databases with init() and init_compact().
+     */
+    enum InitFlags {
+        /** Compress the full posting list chunks.  They are sorted
+         * and delta-encoded, which shrinks the long posting lists of
+         * near-duplicate hashes severalfold, at the cost of decoding
+         * them during lookups.
+         */
+        COMPRESS_CHUNKS = 1
     };
 
     /** Initialise a new hash database file.
@@ -62,6 +218,10 @@ public:
      * The database file should not exist, or if it does it must not
      * contain any records.
      *
+     * Posting lists are stored in chunks of a few kilobytes, so that
+     * inserting a hash with a common partition value only rewrites
+     * the last chunk of its posting list.
+     *
      * Parameters:
      *
      *  - path:       file path, typically ending in ".kch"
@@ -82,6 +242,178 @@ public:
                      uint64_t num_hashes,
                      std::string* error_msg = NULL);
 
+    /** Initialise a new hash database file, balancing the partitions
+     * for hashes like those in sample.
+     *
+     * Real-world hashes often have biased and correlated bits, so
+     * cutting them into contiguous bit ranges gives some partitions
+     * few distinct values and huge posting lists.  This instead
+     * chooses a bit permutation from the sample that spreads the
+     * information in the hashes evenly over the partitions, and
+     * stores it in the database.  Inserts and lookups apply it
+     * transparently.
+     *
+     * The sample should be a few thousand hashes drawn at random from
+     * the data that will be inserted.  An empty sample gives the same
+     * database as the init() above.
+     *
+     * The other parameters are the same as for the init() above.
+     */
+    static bool init(const std::string& path,
+                     unsigned hash_bits, unsigned max_error,
+                     uint64_t num_hashes,
+                     const std::vector<hash_string>& sample,
+                     std::string* error_msg = NULL);
+
+    /** Initialise a new hash database file as the init() above, with
+     * flags being a combination of InitFlags values.
+     */
+    static bool init(const std::string& path,
+                     unsigned hash_bits, unsigned max_error,
+                     uint64_t num_hashes,
+                     const std::vector<hash_string>& sample,
+                     unsigned flags,
+                     std::string* error_msg = NULL);
+
+    /** Initialise a new hash database file with the compact layout.
+     *
+     * Each hash is stored once, under a hash ID, and the partition
+     * records hold the IDs instead of the full hashes.  This makes the
+     * database much smaller for long hashes with many partitions,
+     * at the cost of one more database read for each candidate
+     * that is verified during a lookup.
+     *
+     * Compact databases can't (yet) be created with create_builder(),
+     * opened in MEMORY mode or exported with export_mapped().
+     *
+     * The parameters are the same as for init(), with the addition of:
+     *
+     *  - id_bits:    size of the hash IDs, 32 or 64 bits
+     *
+     * Returns true if the database could be initialised, false on errors.
+     */
+    static bool init_compact(const std::string& path,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned id_bits,
+                             std::string* error_msg = NULL);
+
+    /** Initialise a new hash database file with the compact layout,
+     * balancing the partitions for hashes like those in sample as
+     * described for init().
+     */
+    static bool init_compact(const std::string& path,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned id_bits,
+                             const std::vector<hash_string>& sample,
+                             std::string* error_msg = NULL);
+
+    /** Initialise a new compact hash database file as the
+     * init_compact() above, with flags being a combination of
+     * InitFlags values.
+     */
+    static bool init_compact(const std::string& path,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned id_bits,
+                             const std::vector<hash_string>& sample,
+                             unsigned flags,
+                             std::string* error_msg = NULL);
+
+    /** Initialise a new sharded hash database.
+     *
+     * The database is split over a number of shard databases, each
+     * a separate file next to path that is initialised for an equal
+     * share of num_hashes.  path itself holds a small manifest
+     * recording the settings and the number of shards.  Opening path
+     * opens all the shards behind the usual interface: each inserted
+     * hash goes to one shard, chosen from its bytes, and lookups
+     * query all shards concurrently and merge their matches.  This
+     * spreads the database over several files that can be written and
+     * read in parallel.
+     *
+     * Sharded databases can't be created with create_builder() or
+     * exported with export_mapped() (though each shard can be).
+     *
+     * The parameters are the same as for init() and init_compact(),
+     * with the addition of:
+     *
+     *  - shards:     number of shard databases, 1 to 256
+     *
+     *  - id_bits:    0 for the usual layout, or 32 or 64 for the
+     *                compact layout
+     *
+     * Returns true if the database could be initialised, false on errors.
+     */
+    static bool init_sharded(const std::string& path, unsigned shards,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned id_bits,
+                             const std::vector<hash_string>& sample,
+                             unsigned flags,
+                             std::string* error_msg = NULL);
+
+    /** Interface for building a complete database in one pass,
+     * returned by create_builder().
+     *
+     * Deleting the builder without calling finish() discards the
+     * added hashes.
+     */
+    class Builder
+    {
+    public:
+        /** Add a hash to the database being built.
+         *
+         * Returns true if the hash could be added, false on any error.
+         */
+        virtual bool add(const hash_string& hash,
+                         std::string* error_msg = NULL) = 0;
+
+        /** Write the database file.  No more hashes can be added
+         * after this has been called.
+         *
+         * Returns true if the database could be written, false on
+         * any error.
+         */
+        virtual bool finish(std::string* error_msg = NULL) = 0;
+
+        virtual ~Builder() {}
+
+    protected:
+        Builder() {}
+    };
+
+    /** Create a builder for a new hash database file.
+     *
+     * This is much quicker than init() followed by insert() for
+     * loading a large set of hashes, since the partition records are
+     * sorted in bounded memory (spilling sorted runs to temporary
+     * files next to the database file) and then written once each.
+     * The database is tuned from the exact number of partition keys,
+     * and duplicate hashes are only stored once.
+     *
+     * The database file should not exist, or if it does it must not
+     * contain any records.
+     *
+     * Parameters:
+     *
+     *  - path:         file path, typically ending in ".kch"
+     *
+     *  - hash_bits:    number of bits in the hash (must be a multiple of 8)
+     *
+     *  - max_error:    maximum hamming distance, must be less than hash_bits
+     *
+     *  - memory_limit: approximate number of bytes to use for sorting
+     *                  before spilling to disk
+     *
+     *  - error_msg:  if provided, will be set to an string describing any
+     *                error, or to an empty string if no error occurred.
+     *
+     * Returns the new builder, which must be deleted when done, or
+     * NULL on error.
+     */
+    static Builder* create_builder(const std::string& path,
+                                   unsigned hash_bits, unsigned max_error,
+                                   size_t memory_limit,
+                                   std::string* error_msg = NULL);
+
     /** Open a database file.
      *
      * The returned object must be deleted when not used any longer to
@@ -102,16 +434,80 @@ public:
                           OpenMode mode,
                           std::string* error_msg = NULL);
 
+    /** Open a database file with tuning options.
+     *
+     * The parameters are the same as for open() above, with the
+     * addition of:
+     *
+     *  - options: see OpenOptions.  The options apply to each shard
+     *             of a sharded database.
+     */
+    static HmSearch* open(const std::string& path,
+                          OpenMode mode,
+                          const OpenOptions& options,
+                          std::string* error_msg = NULL);
+
+
+    /** Export a database to a read-only file that can be
+     * memory-mapped.
+     *
+     * open() recognises the exported file and maps it instead of
+     * opening it with Kyoto Cabinet.  Lookups then read the posting
+     * lists directly from the mapping without copying them, and any
+     * number of processes can open the same file at the same time.
+     * The file can only be opened in READONLY or MEMORY mode.
+     *
+     * The exported file is written to a temporary file first, so an
+     * existing file at mapped_path is replaced without disturbing
+     * processes that have it open.
+     *
+     * Parameters:
+     *
+     *  - path:        file path of the database to export
+     *
+     *  - mapped_path: file path of the exported file
+     *
+     *  - error_msg:  if provided, will be set to an string describing any
+     *                error, or to an empty string if no error occurred.
+     *
+     * Returns true if the database could be exported, false on errors.
+     */
+    static bool export_mapped(const std::string& path,
+                              const std::string& mapped_path,
+                              std::string* error_msg = NULL);
+
 
     /** Parse a hash in hexadecimal format, returning
      * a string of raw bytes.
      */
     static hash_string parse_hexhash(const std::string& hexhash);
 
+    /** Parse length hexadecimal digits into length / 2 raw bytes.
+     *
+     * Returns false if any of the digits are invalid.
+     */
+    static bool parse_hexhash(const char* hexhash, size_t length,
+                              uint8_t* hash);
+
     /** Format a hash of raw bytes into a hexadecimal string.
      */
     static std::string format_hexhash(const hash_string& hash);
 
+    /** Format length raw bytes into length * 2 hexadecimal digits.
+     * The digits are not NUL-terminated.
+     */
+    static void format_hexhash(const uint8_t* hash, size_t length,
+                               char* hexhash);
+
+
+    /** Return the number of bits in the hashes of the database.
+     */
+    virtual unsigned hash_bits() const = 0;
+
+    /** Return the maximum hamming distance of the database.
+     */
+    virtual unsigned max_error() const = 0;
+
 
     /** Insert a hash into the database.
      *
@@ -128,6 +524,53 @@ public:
     virtual bool insert(const hash_string& hash,
                         std::string* error_msg = NULL) = 0;
 
+    /** Insert a batch of hashes into the database.
+     *
+     * The hashes are grouped by partition key, so that each key is
+     * only appended to once for the whole batch.  This is much
+     * quicker than inserting the hashes one by one when the batch is
+     * large.
+     *
+     * Parameters:
+     *  - hashes:    The hashes to insert, as raw bytes
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the insert succeded, false on any error.  If
+     * any of the hashes have the wrong length, none are inserted.
+     */
+    virtual bool insert_batch(const std::vector<hash_string>& hashes,
+                              std::string* error_msg = NULL) = 0;
+
+    /** Set the size of the write buffer.
+     *
+     * When the buffer size is non-zero, insert() collects the hashes
+     * in memory instead of writing them immediately.  When the buffer
+     * holds max_hashes hashes, or when flush() or close() is called,
+     * they are written to the database grouped by partition key just
+     * like insert_batch() does.  Buffered hashes are not found by
+     * lookups until they have been written.
+     *
+     * Errors when writing the buffer are reported by the insert(),
+     * flush() or close() call that triggered it, and the hashes that
+     * weren't written stay buffered until the next flush.  Other
+     * insert() calls keep filling a new buffer while one is written.
+     *
+     * The buffer is disabled (zero) by default.  Setting a size
+     * smaller than the number of currently buffered hashes writes
+     * them immediately.
+     *
+     * Returns true if all went well, false on errors.
+     */
+    virtual bool set_write_buffer(size_t max_hashes,
+                                  std::string* error_msg = NULL) = 0;
+
+    /** Write any hashes held in the write buffer to the database.
+     *
+     * Returns true if all went well, false on errors.
+     */
+    virtual bool flush(std::string* error_msg = NULL) = 0;
+
     /** Lookup a hash in the database, returning a list of matches.
      *
      * Parameters:
@@ -142,13 +585,147 @@ public:
      *  - error_msg: if provided, will be set to an string describing any
      *               error, or to an empty string if no error occurred.
      *
+     *  - stats:     if provided, the work done by the lookup is added
+     *               to these counters (which are not reset).  Lookups
+     *               answered by the result cache only count matches.
+     *
      * Returns true if the lookup could be performed (even if no
      * hashes were found), false if an error occurred.
      */
     virtual bool lookup(const hash_string& query,
                         LookupResultList& result,
                         int max_error = -1,
-                        std::string* error_msg = NULL) = 0;
+                        std::string* error_msg = NULL,
+                        LookupStats* stats = NULL) = 0;
+
+    /** Lookup a hash in the database, passing each match to a
+     * callback as it is found.
+     *
+     * This avoids allocating memory for each match, and lets the
+     * callback stop the lookup early.  The parameters are otherwise
+     * the same as for the lookup() above.
+     *
+     * Returns true if the lookup could be performed (even if no
+     * hashes were found or the callback stopped it), false if an
+     * error occurred.
+     */
+    virtual bool lookup(const hash_string& query,
+                        LookupCallback& callback,
+                        int max_error = -1,
+                        std::string* error_msg = NULL,
+                        LookupStats* stats = NULL) = 0;
+
+    /** Lookup a batch of hashes in the database.
+     *
+     * This gives the same matches as calling lookup() for each query,
+     * but the partition keys probed by all the queries are collected
+     * first so that keys shared between queries are only fetched
+     * once from the database.
+     *
+     * Parameters:
+     *
+     *  - queries:   query hash strings
+     *
+     *  - results:   resized to the number of queries, and the matches
+     *               for each query are added to the list with the
+     *               same index (which is not emptied)
+     *
+     *  - max_error: if >= 0, reduce the maximum accepted error
+     *               from the database default
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the lookups could be performed, false if an
+     * error occurred.  On errors, results is not changed.
+     */
+    virtual bool lookup_batch(const std::vector<hash_string>& queries,
+                              std::vector<LookupResultList>& results,
+                              int max_error = -1,
+                              std::string* error_msg = NULL) = 0;
+
+    /** Lookup the hashes closest to a query hash.
+     *
+     * This finds the same hashes as lookup() would, but only the k
+     * with the smallest distances.  The exact-match partition keys
+     * are probed first, and the remaining keys only if the hashes
+     * found so far can't be proven to be the closest ones.  This
+     * makes finding the best few matches for a near-duplicate query
+     * much quicker than finding all matches.
+     *
+     * Parameters:
+     *
+     *  - query:     query hash string
+     *
+     *  - k:         maximum number of matches to return
+     *
+     *  - result:    up to k matches are added to this list (which is
+     *               not emptied) in order of increasing distance.
+     *               Among matches with the same distance as the last
+     *               one it is unspecified which are returned.
+     *
+     *  - max_error: if >= 0, reduce the maximum accepted error
+     *               from the database default
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the lookup could be performed (even if no
+     * hashes were found), false if an error occurred.
+     */
+    virtual bool lookup_nearest(const hash_string& query,
+                                size_t k,
+                                LookupResultList& result,
+                                int max_error = -1,
+                                std::string* error_msg = NULL) = 0;
+
+    /** Spread the work of each lookup() over a pool of threads.
+     *
+     * The partitions of the query are probed and counted in
+     * parallel, which lowers the latency of single lookups on
+     * databases with many partitions or with posting lists that
+     * must be read from disk.  The calling thread works on one of
+     * the partitions too, so threads is the number of additional
+     * threads.
+     *
+     * Setting this to zero, which is the default, stops the pool and
+     * does all lookup work in the calling thread.  This must not be
+     * called while lookups are in progress.  lookup_batch() always
+     * works in the calling thread, since it already shares the
+     * fetches between its queries.
+     */
+    virtual void set_lookup_threads(int threads) = 0;
+
+    /** Cache the results of lookup() and lookup_batch(), keyed by
+     * the query hash and the effective max error, using at most
+     * max_bytes of memory.  The least recently used results are
+     * dropped first.
+     *
+     * This pays off when the same hashes are looked up over and
+     * over.  Any insert() into the database invalidates all cached
+     * results.  lookup_nearest() is not cached.
+     *
+     * Setting this to zero, which is the default, drops the cache.
+     * This must not be called while lookups are in progress.
+     */
+    virtual void set_result_cache(size_t max_bytes) = 0;
+
+    /** Return the sum of the LookupStats of all lookups made
+     * through this object since it was opened or the counters were
+     * last reset.  This includes lookup_batch() and
+     * lookup_nearest(), although the latter doesn't count filtered
+     * candidates or false positives.
+     */
+    virtual LookupStats get_lookup_stats() = 0;
+
+    /** Reset the counters returned by get_lookup_stats().
+     */
+    virtual void reset_lookup_stats() = 0;
+
+    /** Return the lookup result cache counters.  These are all zero
+     * when there is no cache.
+     */
+    virtual CacheStats get_cache_stats() = 0;
 
     /** Explicitly sync and close the database file.
      *
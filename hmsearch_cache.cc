@@ -0,0 +1,153 @@
+/* HmSearch hash lookup library - lookup result cache
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include "hmsearch_impl.h"
+
+// Number of independently locked parts of the cache.  Must be a power
+// of two.
+#define CACHE_SHARDS 16
+
+// Estimated bookkeeping memory per cached lookup, on top of its key
+// and results
+#define CACHE_ENTRY_OVERHEAD 160
+
+ResultCache::ResultCache(size_t max_bytes, int hash_bytes)
+    : _shard_bytes(max_bytes / CACHE_SHARDS)
+    , _hash_bytes(hash_bytes)
+    , _shards(new Shard[CACHE_SHARDS])
+{
+}
+
+
+ResultCache::~ResultCache()
+{
+    delete [] _shards;
+}
+
+
+bool ResultCache::get(const HmSearch::hash_string& query, int max_distance,
+                      int64_t generation, HmSearch::LookupResultList& result)
+{
+    std::string key;
+    Shard& shard = get_shard(query, max_distance, key);
+    kyotocabinet::ScopedMutex lock(&shard.lock);
+
+    EntryMap::iterator i = shard.entries.find(key);
+    if (i == shard.entries.end()) {
+        shard.misses++;
+        return false;
+    }
+
+    EntryList::iterator entry = i->second;
+    if (entry->generation != generation) {
+        // The database has changed since this was cached
+        erase(shard, entry);
+        shard.misses++;
+        return false;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+    shard.hits++;
+
+    result.insert(result.end(), entry->result.begin(), entry->result.end());
+    return true;
+}
+
+
+void ResultCache::put(const HmSearch::hash_string& query, int max_distance,
+                      int64_t generation, const HmSearch::LookupResultList& result)
+{
+    size_t bytes = (CACHE_ENTRY_OVERHEAD + query.length() + 1
+                    + result.size() * (sizeof(HmSearch::LookupResult) + _hash_bytes));
+
+    if (bytes > _shard_bytes) {
+        return;
+    }
+
+    std::string key;
+    Shard& shard = get_shard(query, max_distance, key);
+    kyotocabinet::ScopedMutex lock(&shard.lock);
+
+    std::pair<EntryMap::iterator, bool> i =
+        shard.entries.insert(EntryMap::value_type(key, shard.lru.end()));
+
+    if (!i.second) {
+        // Another lookup got here first.  Keep whichever result is
+        // from the newer generation.
+        if (i.first->second->generation >= generation) {
+            return;
+        }
+
+        shard.bytes -= i.first->second->bytes;
+        shard.lru.erase(i.first->second);
+    }
+
+    shard.lru.push_front(Entry());
+
+    Entry& entry = shard.lru.front();
+    entry.key = i.first;
+    entry.generation = generation;
+    entry.bytes = bytes;
+    entry.result = result;
+
+    i.first->second = shard.lru.begin();
+    shard.bytes += bytes;
+
+    while (shard.bytes > _shard_bytes) {
+        erase(shard, --shard.lru.end());
+    }
+}
+
+
+HmSearch::CacheStats ResultCache::get_stats()
+{
+    HmSearch::CacheStats stats;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        Shard& shard = _shards[i];
+        kyotocabinet::ScopedMutex lock(&shard.lock);
+
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.entries += shard.entries.size();
+        stats.bytes += shard.bytes;
+    }
+
+    return stats;
+}
+
+
+ResultCache::Shard& ResultCache::get_shard(const HmSearch::hash_string& query,
+                                           int max_distance, std::string& key)
+{
+    // max_error goes up to 518, so the distance needs two bytes
+    key.reserve(query.length() + 2);
+    key.assign((const char*) query.data(), query.length());
+    key.push_back((char) (max_distance >> 8));
+    key.push_back((char) (max_distance & 0xff));
+
+    // Hashes are not necessarily uniform in their first bits, so mix
+    // them before picking the shard
+    uint64_t w = load_tail(query.data(), query.length() < 8 ? query.length() : 8);
+    w = (w ^ max_distance) * 0x9e3779b97f4a7c15ULL;
+
+    return _shards[(w >> 32) & (CACHE_SHARDS - 1)];
+}
+
+
+void ResultCache::erase(Shard& shard, EntryList::iterator entry)
+{
+    shard.bytes -= entry->bytes;
+    shard.entries.erase(entry->key);
+    shard.lru.erase(entry);
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,1307 @@
+/* HmSearch hash lookup library - internal declarations
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __HMSEARCH_IMPL_H_INCLUDED__
+#define __HMSEARCH_IMPL_H_INCLUDED__
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <kcdbext.h>
+
+#include "hmsearch.h"
+
+static inline uint64_t load_word(const uint8_t* p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline uint64_t load_tail(const uint8_t* p, int bytes)
+{
+    uint64_t w = 0;
+    memcpy(&w, p, bytes);
+    return w;
+}
+
+
+/** Partition match counts for a hash seen during a lookup.
+ */
+struct Candidate {
+    Candidate() : matches(0), exact_matches(0), first_match(0), second_match(0) {}
+    int matches;
+    int exact_matches;
+    int first_match;
+    int second_match;
+};
+
+
+/** Open-addressing hash table holding the candidates of a lookup.
+ *
+ * The keys are pointers to entries (hashes, or hash IDs in compact
+ * databases) inside the posting lists fetched for the lookup, so
+ * these buffers must be kept alive as long as the table is used.  The
+ * table is sized up front from the total posting-list length, so
+ * inserts never rehash or allocate.
+ */
+class CandidateTable
+{
+public:
+    struct Entry {
+        uint64_t word;
+        const uint8_t* hash;
+        Candidate candidate;
+    };
+
+    CandidateTable(int entry_bytes)
+        : _entry_bytes(entry_bytes)
+        , _mask(0)
+        , _count(0)
+        { }
+
+    /** Empty the table and make room for at least max_entries
+     * distinct hashes.
+     */
+    void reset(size_t max_entries) {
+        size_t slots = 16;
+        while (slots < max_entries * 2) {
+            slots <<= 1;
+        }
+
+        Entry empty;
+        empty.word = 0;
+        empty.hash = NULL;
+        _entries.assign(slots, empty);
+        _mask = slots - 1;
+        _count = 0;
+    }
+
+    Candidate& get(const uint8_t* hash) {
+        uint64_t word = fold_hash(hash);
+        size_t i = (word * 0x9e3779b97f4a7c15ULL) >> 32;
+
+        for (;; i++) {
+            Entry& e = _entries[i & _mask];
+
+            if (!e.hash) {
+                e.word = word;
+                e.hash = hash;
+                e.candidate = Candidate();
+                ++_count;
+                return e.candidate;
+            }
+
+            if (e.word == word
+                && (_entry_bytes <= 8 || memcmp(e.hash, hash, _entry_bytes) == 0)) {
+                return e.candidate;
+            }
+        }
+    }
+
+    size_t count() const { return _count; }
+
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+    // Iteration includes empty slots, which have a NULL hash
+    const_iterator begin() const { return _entries.begin(); }
+    const_iterator end() const { return _entries.end(); }
+
+private:
+    /** Fold the entry into one 64-bit word.  For entries of at most 8
+     * bytes this is the entry itself, so the word alone identifies it.
+     */
+    uint64_t fold_hash(const uint8_t* hash) const {
+        if (_entry_bytes <= 8) {
+            return load_tail(hash, _entry_bytes);
+        }
+
+        uint64_t word = 0;
+        int i = 0;
+        for (; i + 8 <= _entry_bytes; i += 8) {
+            word = ((word << 23) | (word >> 41)) ^ load_word(hash + i);
+        }
+        if (i < _entry_bytes) {
+            word = ((word << 23) | (word >> 41)) ^ load_tail(hash + i, _entry_bytes - i);
+        }
+        return word;
+    }
+
+    int _entry_bytes;
+    size_t _mask;
+    size_t _count;
+    std::vector<Entry> _entries;
+};
+
+
+/** Orders probe indices by the fixed-length partition keys they
+ * refer to.
+ */
+struct ProbeKeyLess {
+    ProbeKeyLess(const uint8_t* k, int l) : keys(k), length(l) {}
+
+    bool operator()(size_t a, size_t b) const {
+        return memcmp(keys + a * length, keys + b * length, length) < 0;
+    }
+
+    const uint8_t* keys;
+    int length;
+};
+
+
+/** Collects the matches of a lookup in a list.
+ */
+class ResultCollector : public HmSearch::LookupCallback
+{
+public:
+    ResultCollector(HmSearch::LookupResultList& result, int hash_bytes)
+        : _result(result)
+        , _hash_bytes(hash_bytes)
+        { }
+
+    bool match(const uint8_t* hash, int distance) {
+        _result.push_back(HmSearch::LookupResult(
+                              HmSearch::hash_string(hash, _hash_bytes), distance));
+        return true;
+    }
+
+private:
+    HmSearch::LookupResultList& _result;
+    int _hash_bytes;
+};
+
+
+/** The k closest matches found so far by a nearest-neighbour lookup,
+ * kept in a heap with the farthest match first.
+ */
+class NearestMatches
+{
+public:
+    NearestMatches(size_t k) : _k(k) {}
+
+    bool full() const { return _matches.size() >= _k; }
+
+    // Distance of the farthest match, only valid when full()
+    int worst() const { return _matches.front().distance; }
+
+    /** Add a match, unless it has already been added or is farther
+     * away than all the k matches already found.
+     */
+    void add(const HmSearch::hash_string& hash, int distance) {
+        if (_hashes.count(hash)) {
+            return;
+        }
+
+        if (full()) {
+            if (distance >= worst()) {
+                return;
+            }
+
+            std::pop_heap(_matches.begin(), _matches.end(), DistanceLess());
+            _hashes.erase(_matches.back().hash);
+            _matches.pop_back();
+        }
+
+        _matches.push_back(HmSearch::LookupResult(hash, distance));
+        std::push_heap(_matches.begin(), _matches.end(), DistanceLess());
+        _hashes.insert(hash);
+    }
+
+    /** Add the matches to result in order of increasing distance.
+     */
+    void get(HmSearch::LookupResultList& result) {
+        std::sort(_matches.begin(), _matches.end(), DistanceLess());
+        result.insert(result.end(), _matches.begin(), _matches.end());
+    }
+
+private:
+    struct DistanceLess {
+        bool operator()(const HmSearch::LookupResult& a,
+                        const HmSearch::LookupResult& b) const {
+            return a.distance < b.distance;
+        }
+    };
+
+    size_t _k;
+    std::vector<HmSearch::LookupResult> _matches;
+    std::set<HmSearch::hash_string> _hashes;
+};
+
+
+/** Lets a thread wait until a number of tasks have finished.
+ */
+class LookupLatch
+{
+public:
+    LookupLatch(int count) : _count(count) {}
+
+    void count_down() {
+        kyotocabinet::ScopedMutex lock(&_lock);
+        if (--_count == 0) {
+            _cond.broadcast();
+        }
+    }
+
+    void wait() {
+        kyotocabinet::ScopedMutex lock(&_lock);
+        while (_count > 0) {
+            _cond.wait(&_lock);
+        }
+    }
+
+private:
+    kyotocabinet::Mutex _lock;
+    kyotocabinet::CondVar _cond;
+    int _count;
+};
+
+
+/** A sharded LRU cache of lookup results.
+ *
+ * Entries are keyed by the query hash and the max distance of the
+ * lookup, and tagged with the database generation when the lookup
+ * started.  Entries from an older generation are treated as misses,
+ * so inserts can invalidate the whole cache by bumping the
+ * generation.  Each shard has its own lock and an equal share of the
+ * memory budget.
+ */
+class ResultCache
+{
+public:
+    ResultCache(size_t max_bytes, int hash_bytes);
+    ~ResultCache();
+
+    /** Add the cached matches for a query to result.  Returns false
+     * on a miss.
+     */
+    bool get(const HmSearch::hash_string& query, int max_distance,
+             int64_t generation, HmSearch::LookupResultList& result);
+
+    void put(const HmSearch::hash_string& query, int max_distance,
+             int64_t generation, const HmSearch::LookupResultList& result);
+
+    HmSearch::CacheStats get_stats();
+
+private:
+    struct Entry;
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+    struct Entry {
+        EntryMap::iterator key;
+        int64_t generation;
+        size_t bytes;
+        HmSearch::LookupResultList result;
+    };
+
+    struct Shard {
+        Shard() : bytes(0), hits(0), misses(0) {}
+
+        kyotocabinet::Mutex lock;
+
+        // Most recently used first
+        EntryList lru;
+        EntryMap entries;
+        size_t bytes;
+
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    Shard& get_shard(const HmSearch::hash_string& query, int max_distance,
+                     std::string& key);
+    void erase(Shard& shard, EntryList::iterator entry);
+
+    size_t _shard_bytes;
+    int _hash_bytes;
+    Shard* _shards;
+};
+
+
+/** Records the matches passed on to another callback, so that they
+ * can be cached if the callback doesn't stop the lookup.
+ */
+class ResultRecorder : public HmSearch::LookupCallback
+{
+public:
+    ResultRecorder(HmSearch::LookupCallback& callback, int hash_bytes)
+        : complete(true)
+        , _callback(callback)
+        , _collector(result, hash_bytes)
+        { }
+
+    bool match(const uint8_t* hash, int distance) {
+        _collector.match(hash, distance);
+        complete = _callback.match(hash, distance);
+        return complete;
+    }
+
+    HmSearch::LookupResultList result;
+    bool complete;
+
+private:
+    HmSearch::LookupCallback& _callback;
+    ResultCollector _collector;
+};
+
+
+/** Reads a database file from start to end, so that it is in the
+ * OS page cache when lookups need it, either in the calling thread
+ * or on a thread of its own.
+ */
+class Prewarmer : public kyotocabinet::Thread
+{
+public:
+    /** Prewarm the file at path as requested by options.  With
+     * PREWARM_BACKGROUND the running prewarmer is returned in
+     * background, and must be deleted to stop it.  Returns false on
+     * errors.
+     */
+    static bool prewarm(const std::string& path,
+                        const HmSearch::OpenOptions& options,
+                        Prewarmer** background,
+                        std::string* error_msg);
+
+    ~Prewarmer();
+
+    void run();
+
+private:
+    Prewarmer(const std::string& path, int fd, uint64_t size,
+              HmSearch::PrewarmCallback* callback)
+        : _path(path)
+        , _fd(fd)
+        , _size(size)
+        , _callback(callback)
+        , _started(false)
+        { }
+
+    std::string _path;
+    int _fd;
+    uint64_t _size;
+    HmSearch::PrewarmCallback* _callback;
+    bool _started;
+    kyotocabinet::AtomicInt64 _stop;
+};
+
+
+/** The partitioning of hashes for a given hash size and max error.
+ *
+ * Each partition is stored as a key on the following format:
+ *  Byte 0: 'P'
+ *  Byte 1: Partition number (thus limiting to max error 518)
+ *  Bytes 2-N: Partition bits.
+ *
+ * The partition bits are normally contiguous bit ranges of the hash,
+ * but a database may have a bit permutation which is applied to the
+ * hash first (see partition_hash()).  This does not change the
+ * hamming distance between hashes, only which bits end up together
+ * in a partition.
+ */
+class PartitionLayout
+{
+public:
+    /** Take the partition keys from hashes with their bits permuted,
+     * so that bit i of the permuted hash is bit permutation[i] of the
+     * hash.  Bits are numbered from the most significant bit of the
+     * first byte.  An empty permutation uses the hash as it is.
+     */
+    void set_permutation(const std::vector<uint16_t>& permutation);
+
+protected:
+    PartitionLayout(int hash_bits, int max_error)
+        : _hash_bits(hash_bits)
+        , _max_error(max_error)
+        , _hash_bytes((hash_bits + 7) / 8)
+        , _partitions((max_error + 3) / 2)
+        , _partition_bits(ceil((double)hash_bits / _partitions))
+        , _partition_bytes((_partition_bits + 7) / 8 + 1)
+        , _permute_words((_hash_bytes + 7) / 8)
+        { }
+
+    int key_length() const { return _partition_bytes + 2; }
+    int probes_per_query() const { return _partitions * (_partition_bits + 1); }
+
+    /** Return the hash that the partition keys of hash are taken
+     * from: hash itself, or the permuted hash stored in buffer, which
+     * must be _hash_bytes long.
+     */
+    const uint8_t* partition_hash(const uint8_t* hash, uint8_t* buffer) const {
+        if (_permute_table.empty()) {
+            return hash;
+        }
+
+        uint64_t permuted[_permute_words];
+        memset(permuted, 0, sizeof(permuted));
+
+        // OR together the permuted bits of each byte value
+        for (int i = 0; i < _hash_bytes; i++) {
+            const uint64_t* row = &_permute_table[(i * 256 + hash[i]) * _permute_words];
+            for (int w = 0; w < _permute_words; w++) {
+                permuted[w] |= row[w];
+            }
+        }
+
+        memcpy(buffer, permuted, _hash_bytes);
+        return buffer;
+    }
+
+    /** Get the key for a partition of a hash returned by
+     * partition_hash().
+     */
+    int get_partition_key(const uint8_t* hash, int partition, uint8_t *key) const;
+
+    int _hash_bits;
+    int _max_error;
+    int _hash_bytes;
+    int _partitions;
+    int _partition_bits;
+    int _partition_bytes;
+
+    std::vector<uint16_t> _permutation;
+
+    // For each byte of the hash and each value of it, the bits that
+    // it sets in the permuted hash
+    std::vector<uint64_t> _permute_table;
+    int _permute_words;
+};
+
+
+/** Lookups shared by all database engines.
+ *
+ * A difference between this implementation and the HmSearch algorithm
+ * in the paper is that only exact-matches are stored in the database,
+ * not the 1-matches.  The 1-var partitions are instead generated
+ * during lookup.  This drastically reduces database size, which with
+ * Kyoto Cabinet speeds up insertion and probably lookups too.
+ *
+ * The engines only need to provide the posting list stored for each
+ * partition key.
+ */
+class HmSearchBase : public HmSearch, protected PartitionLayout
+{
+public:
+    using PartitionLayout::set_permutation;
+
+    bool lookup(const hash_string& query,
+                LookupResultList& result,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup(const hash_string& query,
+                LookupCallback& callback,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup_batch(const std::vector<hash_string>& queries,
+                      std::vector<LookupResultList>& results,
+                      int max_error = -1,
+                      std::string* error_msg = NULL);
+
+    bool lookup_nearest(const hash_string& query,
+                        size_t k,
+                        LookupResultList& result,
+                        int max_error = -1,
+                        std::string* error_msg = NULL);
+
+    void set_lookup_threads(int threads);
+
+    void set_result_cache(size_t max_bytes);
+    CacheStats get_cache_stats();
+
+    LookupStats get_lookup_stats();
+    void reset_lookup_stats();
+
+    unsigned hash_bits() const { return _hash_bits; }
+    unsigned max_error() const { return _max_error; }
+
+    /** Take ownership of a background prewarmer, which is stopped
+     * when the database is deleted.
+     */
+    void set_prewarmer(Prewarmer* prewarmer) {
+        delete _prewarmer;
+        _prewarmer = prewarmer;
+    }
+
+protected:
+    HmSearchBase(int hash_bits, int max_error, int id_bits = 0)
+        : PartitionLayout(hash_bits, max_error)
+        , _id_bytes(id_bits / 8)
+        , _entry_bytes(_id_bytes ? _id_bytes : _hash_bytes)
+        , _distance(select_distance_func(_hash_bytes))
+        , _probe_keys(select_probe_key_func(hash_bits, max_error))
+        , _lookup_queue(NULL)
+        , _cache(NULL)
+        , _prewarmer(NULL)
+        { }
+
+    ~HmSearchBase();
+
+    /** Invalidate all cached lookup results.  Engines call this
+     * after (not before) changing the posting lists, so that no
+     * lookup can cache results from before the change under the new
+     * generation.
+     */
+    void invalidate_cache() {
+        _cache_generation.add(1);
+    }
+
+    /** Return true if the database is open.
+     */
+    virtual bool is_open() const = 0;
+
+    /** Find the posting list stored for a partition key (which is
+     * key_length() bytes).  Engines that cannot point into their own
+     * storage copy the hashes into buffer, which is reused between
+     * lookups so assigning to it rarely has to allocate.
+     *
+     * Returns false if there is no record for the key.
+     */
+    virtual bool get_posting_list(const uint8_t* key, std::string& buffer,
+                                  const uint8_t** hashes, size_t* length) = 0;
+
+    /** Find the posting lists of count partition keys, stored
+     * back-to-back.  Each key gets its own buffer as for
+     * get_posting_list(), and hashes[i] is set to NULL if key i has
+     * no record.
+     *
+     * Since all the keys of a lookup are known up front, engines can
+     * overlap their reads instead of waiting for each in turn, which
+     * matters when the database doesn't fit in RAM.  The default
+     * calls get_posting_list() for each key.
+     */
+    virtual void get_posting_lists(const uint8_t* keys, size_t count,
+                                   std::string* buffers,
+                                   const uint8_t** hashes, size_t* lengths);
+
+    /** Find the hash stored for a hash ID (which is _id_bytes long)
+     * in a compact database, copying it into buffer if necessary.
+     *
+     * Returns false if there is no such hash.
+     */
+    virtual bool get_hash(const uint8_t* id, std::string& buffer,
+                          const uint8_t** hash) {
+        return false;
+    }
+
+    // Hash ID size in compact databases, otherwise 0
+    int _id_bytes;
+
+    // Size of each posting-list entry, which is either a hash or a
+    // hash ID
+    int _entry_bytes;
+
+private:
+    /** Hamming distance kernel.  Returns the distance between the
+     * two hashes, or any value above max_distance as soon as the
+     * running count passes it.
+     */
+    typedef int (*DistanceFunc)(const uint8_t* a, const uint8_t* b,
+                                int bytes, int max_distance);
+
+    static DistanceFunc select_distance_func(int hash_bytes);
+
+    /** A posting list found by one of the probes of a lookup.
+     */
+    struct PostingList {
+        PostingList(int m, const uint8_t* h, size_t l)
+            : match(m)
+            , hashes(h)
+            , length(l)
+            { }
+        int match;
+        const uint8_t* hashes;
+        size_t length;
+    };
+
+    typedef std::vector<PostingList> PostingLists;
+
+    /** Buffers for the posting lists fetched by a lookup.  These are
+     * pooled between lookups to keep their capacity.
+     */
+    typedef std::vector<std::string> PostingBuffers;
+
+    /** Partition keys to probe, stored back-to-back with
+     * key_length() bytes per key, and whether each key is an exact
+     * (0) or 1-variant (1) match.
+     */
+    struct ProbeKeys {
+        std::vector<uint8_t> keys;
+        std::vector<uint8_t> matches;
+    };
+
+    /** Probe key generator for one hash size and max error, adding
+     * the probe keys of the given partitions of a hash returned by
+     * partition_hash() to probes.
+     */
+    typedef void (*ProbeKeyFunc)(const uint8_t* hash,
+                                 int first_partition, int end_partition,
+                                 ProbeKeys& probes);
+
+    /** Return the generator specialised for the layout, or NULL if
+     * the generic code in get_probe_keys() should be used.
+     */
+    static ProbeKeyFunc select_probe_key_func(int hash_bits, int max_error);
+
+    template <int HashBits, int MaxError>
+    static void get_fixed_probe_keys(const uint8_t* hash,
+                                     int first_partition, int end_partition,
+                                     ProbeKeys& probes);
+
+    int effective_max_error(int reduced_error) const {
+        return (reduced_error >= 0 && reduced_error < _max_error
+                ? reduced_error : _max_error);
+    }
+
+    /** Counts the candidates of one partition of a lookup on the
+     * lookup thread pool.
+     */
+    struct PartitionTask : public kyotocabinet::TaskQueue::Task {
+        PartitionTask(HmSearchBase* d, const hash_string* q, int p,
+                      LookupLatch* l)
+            : db(d)
+            , query(q)
+            , partition(p)
+            , latch(l)
+            , buffers(d->acquire_buffers())
+            , candidates(d->_entry_bytes)
+            { }
+        ~PartitionTask() {
+            db->release_buffers(buffers);
+        }
+        HmSearchBase* db;
+        const hash_string* query;
+        int partition;
+        LookupLatch* latch;
+        PostingBuffers* buffers;
+        CandidateTable candidates;
+        LookupStats stats;
+    };
+
+    /** The lookup thread pool.  Tasks are owned by the lookup that
+     * queued them, which waits on their latch.
+     */
+    class LookupQueue : public kyotocabinet::TaskQueue {
+    public:
+        void do_task(Task* task);
+    };
+
+    PostingBuffers* acquire_buffers();
+    void release_buffers(PostingBuffers* buffers);
+
+    void get_probe_keys(const hash_string& query,
+                        int first_partition, int end_partition,
+                        ProbeKeys& probes);
+    void get_candidates(const hash_string& query,
+                        int first_partition, int end_partition,
+                        PostingBuffers& buffers,
+                        CandidateTable& candidates,
+                        LookupStats& stats);
+    void fetch_posting_lists(const ProbeKeys& probes, int match,
+                             PostingBuffers& buffers, PostingLists& postings);
+    void verify_nearest(const hash_string& query,
+                        const CandidateTable& candidates,
+                        int max_distance, bool all_probed,
+                        NearestMatches& nearest);
+    void get_candidates_parallel(const hash_string& query,
+                                 std::vector<PartitionTask*>& tasks,
+                                 CandidateTable& candidates,
+                                 LookupStats& stats);
+    void count_candidates(const PostingLists& postings,
+                          CandidateTable& candidates);
+    void add_hash_candidates(CandidateTable& candidates, int match,
+                             const uint8_t* entries, size_t length);
+    void merge_candidates(CandidateTable& candidates,
+                          const CandidateTable& partial);
+    bool find_matches(const hash_string& query, int reduced_error,
+                      LookupCallback& callback, LookupResultList* result,
+                      std::string* error_msg, LookupStats& stats);
+    void find_batch_matches(const std::vector<hash_string>& queries,
+                            int max_distance,
+                            std::vector<LookupResultList>& results,
+                            LookupStats& stats);
+    void count_postings(const PostingLists& postings, LookupStats& stats);
+    void add_stats(const LookupStats& stats, LookupStats* caller_stats);
+    size_t count_valid_candidates(const CandidateTable& candidates);
+    void verify_candidates(const hash_string& query,
+                           const CandidateTable& candidates,
+                           int max_distance,
+                           LookupCallback& callback,
+                           LookupStats& stats);
+    bool valid_candidate(const Candidate& candidate);
+    int hamming_distance(const uint8_t* query, const uint8_t* hash,
+                         int max_distance) {
+        return _distance(query, hash, _hash_bytes, max_distance);
+    }
+
+    DistanceFunc _distance;
+    ProbeKeyFunc _probe_keys;
+    LookupQueue* _lookup_queue;
+
+    kyotocabinet::SpinLock _buffers_lock;
+    std::vector<PostingBuffers*> _free_buffers;
+
+    ResultCache* _cache;
+    kyotocabinet::AtomicInt64 _cache_generation;
+
+    kyotocabinet::SpinLock _stats_lock;
+    LookupStats _stats;
+
+    Prewarmer* _prewarmer;
+};
+
+
+/** The layout of full posting list chunks in a chunked database.
+ *
+ * A chunk holds `entries` posting list entries of entry_bytes each,
+ * which are hashes, or big-endian hash IDs if ids is set.  Chunk
+ * records are written once, so they can be compressed: the entries
+ * are sorted and hash IDs are stored as varint deltas, while each
+ * hash is stored as a bitmap of the bytes that differ from the
+ * previous hash followed by those bytes XORed with it.  Near
+ * duplicates and the partition bytes they all share thus take no
+ * space.
+ */
+struct ChunkFormat
+{
+    ChunkFormat()
+        : entries(0)
+        , entry_bytes(0)
+        , ids(false)
+        , compressed(false)
+        { }
+
+    // Bytes in a chunk once decoded
+    size_t bytes() const { return size_t(entries) * entry_bytes; }
+
+    /** Encode the bytes() long chunk into record.
+     */
+    void encode(const uint8_t* chunk, std::string& record) const;
+
+    /** Decode a chunk record into bytes() at chunk.  Returns false if
+     * the record is corrupt.
+     */
+    bool decode(const char* record, size_t length, uint8_t* chunk) const;
+
+    // Entries per chunk, or 0 if the database isn't chunked
+    int entries;
+    int entry_bytes;
+    bool ids;
+    bool compressed;
+};
+
+
+/** The actual implementation of the HmSearch database, stored in
+ * Kyoto Cabinet.
+ *
+ * The database contains some setting records controlling the
+ * operation:
+ *
+ * _hb: hash bits
+ * _me: max errors
+ * _ib: hash ID bits, only in compact databases
+ * _ce: posting list entries per chunk, only in chunked databases
+ * _cz: 1 if full chunks are compressed, see ChunkFormat
+ *
+ * These can't be changed once the database has been initialised.
+ *
+ * The partition keys are described in PartitionLayout.  In compact
+ * databases their posting lists hold big-endian hash IDs, and each
+ * hash is stored under the key 'H' followed by its ID.  The record _ni
+ * counts the IDs handed out so far.
+ *
+ * In chunked databases each partition record starts with the number
+ * of full chunks of the posting list as a big-endian uint32_t,
+ * followed by the entries of the tail chunk.  When the tail is full
+ * it is moved to a chunk record, keyed by 'C', the rest of the
+ * partition key and the big-endian uint32_t chunk number.  Inserts
+ * thus only ever rewrite a small record, however long the posting
+ * list grows.
+ */
+class HmSearchImpl : public HmSearchBase
+{
+public:
+    HmSearchImpl(kyotocabinet::PolyDB* db, int hash_bits, int max_error,
+                 int id_bits, const ChunkFormat& chunks)
+        : HmSearchBase(hash_bits, max_error, id_bits)
+        , _db(db)
+        , _chunks(chunks)
+        , _buffer_size(0)
+        { }
+
+    ~HmSearchImpl() {
+        close();
+    }
+    
+    bool insert(const hash_string& hash,
+                std::string* error_msg = NULL);
+
+    bool insert_batch(const std::vector<hash_string>& hashes,
+                      std::string* error_msg = NULL);
+
+    bool set_write_buffer(size_t max_hashes,
+                          std::string* error_msg = NULL);
+
+    bool flush(std::string* error_msg = NULL);
+
+    bool close(std::string* error_msg = NULL);
+
+    void dump();
+
+protected:
+    bool is_open() const { return _db != NULL; }
+
+    bool get_posting_list(const uint8_t* key, std::string& buffer,
+                          const uint8_t** hashes, size_t* length);
+
+    void get_posting_lists(const uint8_t* keys, size_t count,
+                           std::string* buffers,
+                           const uint8_t** hashes, size_t* lengths);
+
+    bool get_hash(const uint8_t* id, std::string& buffer,
+                  const uint8_t** hash);
+
+private:
+    /** Entries waiting to be appended, concatenated per partition key,
+     * along with the hash records of compact databases.
+     */
+    typedef std::map<std::string, std::string> PartitionBuffer;
+
+    bool allocate_ids(size_t count, uint64_t* first_id, std::string* error_msg);
+    void get_entry(const hash_string& hash, uint64_t id, uint8_t* entry) const;
+    std::string hash_key(const uint8_t* id) const;
+
+    void buffer_partitions(PartitionBuffer& buffer, const hash_string& hash,
+                           const uint8_t* entry);
+    bool write_partitions(PartitionBuffer& buffer, std::string* error_msg);
+    bool flush_buffer(std::string* error_msg);
+
+    bool append_partition(const char* key, const char* entries, size_t length,
+                          std::string* error_msg);
+    bool move_full_chunks(const char* key, std::string* error_msg);
+    std::string chunk_key(const char* key, uint32_t chunk) const;
+    long make_chunk_space(std::string& buffer) const;
+
+    kyotocabinet::PolyDB* _db;
+
+    ChunkFormat _chunks;
+    kyotocabinet::Mutex _chunk_lock;
+
+    kyotocabinet::Mutex _buffer_lock;
+    PartitionBuffer _buffer;
+    std::vector<hash_string> _buffer_hashes;
+    size_t _buffer_size;
+};
+
+
+/** The sorted partition values of a database and the layout of
+ * their posting lists, collected in a pass over a Kyoto Cabinet
+ * database.  This is used to load or export a database for the
+ * read-only engines.
+ *
+ * Partition values are partition_bytes each, and the posting list
+ * of value i in a partition is at offsets[i] to offsets[i + 1] in an
+ * arena holding all posting lists back-to-back.  The chunks of a
+ * chunked posting list are placed in chunk order, followed by the
+ * tail.
+ */
+class PartitionDirectory
+{
+public:
+    struct Partition {
+        std::vector<uint8_t> values;
+        std::vector<uint64_t> offsets;
+    };
+
+    /** Receives the posting lists from copy_posting_lists().
+     */
+    class Writer {
+    public:
+        virtual ~Writer() {}
+        virtual bool write(uint64_t offset, const char* data, size_t length,
+                           std::string* error_msg) = 0;
+    };
+
+    PartitionDirectory(int partitions, int partition_bytes, const ChunkFormat& chunks)
+        : _partitions(partitions)
+        , _partition_bytes(partition_bytes)
+        , _chunks(chunks)
+        , _arena_length(0)
+        { }
+
+    /** Collect and sort the partition values of all partition records.
+     */
+    bool read(kyotocabinet::BasicDB* db, std::string* error_msg);
+
+    /** Pass each posting list to writer along with its arena offset.
+     */
+    bool copy_posting_lists(kyotocabinet::BasicDB* db, Writer* writer,
+                            std::string* error_msg);
+
+    uint64_t arena_length() const { return _arena_length; }
+    std::vector<Partition>& partitions() { return _index; }
+
+private:
+    class SizeVisitor;
+    class CopyVisitor;
+
+    bool partition_record(const char* key, size_t length) const {
+        return (length == (size_t) _partition_bytes + 2 && key[0] == 'P'
+                && (uint8_t) key[1] < _partitions);
+    }
+
+    bool chunk_record(const char* key, size_t length) const {
+        return (_chunks.entries && length == (size_t) _partition_bytes + 6
+                && key[0] == 'C' && (uint8_t) key[1] < _partitions);
+    }
+
+    long find_value(const char* key) const;
+
+    int _partitions;
+    int _partition_bytes;
+    ChunkFormat _chunks;
+    uint64_t _arena_length;
+    std::vector<Partition> _index;
+};
+
+
+/** Find a value in a sorted array of count values, each value_bytes
+ * long.  Returns its index, or -1 if not found.
+ */
+long find_partition_value(const uint8_t* values, uint64_t count,
+                          int value_bytes, const uint8_t* value);
+
+
+/** Base for the read-only engines that keep a sorted directory of
+ * partition values pointing into one arena of posting lists, as
+ * described in PartitionDirectory.  Lookups never copy posting lists.
+ */
+class HmSearchSorted : public HmSearchBase
+{
+public:
+    bool insert(const hash_string& hash,
+                std::string* error_msg = NULL);
+
+    bool insert_batch(const std::vector<hash_string>& hashes,
+                      std::string* error_msg = NULL);
+
+    bool set_write_buffer(size_t max_hashes,
+                          std::string* error_msg = NULL);
+
+    bool flush(std::string* error_msg = NULL);
+
+    void dump();
+
+protected:
+    HmSearchSorted(int hash_bits, int max_error)
+        : HmSearchBase(hash_bits, max_error)
+        , _arena(NULL)
+        , _open(false)
+        { }
+
+    /** Where the directory of each partition is stored.
+     */
+    struct PartitionView {
+        const uint8_t* values;
+        const uint64_t* offsets;
+        uint64_t count;
+    };
+
+    bool is_open() const { return _open; }
+
+    bool get_posting_list(const uint8_t* key, std::string& buffer,
+                          const uint8_t** hashes, size_t* length);
+
+    std::vector<PartitionView> _views;
+    const uint8_t* _arena;
+    bool _open;
+};
+
+
+/** A read-only database held entirely in memory.
+ *
+ * The partition records are loaded from a Kyoto Cabinet database
+ * when opened, which is then closed again so that lookups never call
+ * into Kyoto Cabinet.
+ */
+class HmSearchMemory : public HmSearchSorted
+{
+public:
+    HmSearchMemory(int hash_bits, int max_error)
+        : HmSearchSorted(hash_bits, max_error)
+        { }
+
+    /** Load all partition records from db, which has the given chunk
+     * layout.
+     */
+    bool load(kyotocabinet::BasicDB* db, const ChunkFormat& chunks,
+              std::string* error_msg);
+
+    bool close(std::string* error_msg = NULL);
+
+private:
+    class ArenaWriter;
+
+    std::vector<PartitionDirectory::Partition> _index;
+    std::vector<uint8_t> _arena_buffer;
+};
+
+
+/** A read-only database memory-mapped from a file written by
+ * HmSearch::export_mapped().
+ *
+ * The file starts with a MappedHeader, followed by a MappedPartition
+ * per partition, and then the sorted partition values and posting
+ * list offsets of each partition and the posting list arena at the
+ * offsets given in those headers.  If the database has a partition
+ * bit permutation, it is stored as hash_bits uint16_t values.  All
+ * integers are stored in native byte order, so the file can only be
+ * used on machines with the same byte order as where it was written.
+ *
+ * Any number of processes can map the same file, sharing the pages in
+ * the page cache.
+ */
+class HmSearchMapped : public HmSearchSorted
+{
+public:
+    struct MappedHeader {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t version;
+        uint32_t hash_bits;
+        uint32_t max_error;
+        uint32_t partitions;
+        uint32_t partition_bytes;
+        uint64_t arena_offset;
+        uint64_t arena_length;
+
+        // 0 if there is no bit permutation
+        uint64_t permutation_offset;
+    };
+
+    struct MappedPartition {
+        uint64_t count;
+        uint64_t values_offset;
+        uint64_t offsets_offset;
+    };
+
+    static const char magic[8];
+    static const uint32_t byte_order = 0x01020304;
+    static const uint32_t version = 2;
+
+    /** Return true if path is a mapped database file.
+     */
+    static bool is_mapped_file(const std::string& path);
+
+    /** Map a database file, optionally reading all of it into the page
+     * cache immediately.  Returns NULL on errors.
+     */
+    static HmSearchMapped* map_file(const std::string& path, bool populate,
+                                    std::string* error_msg);
+
+    ~HmSearchMapped() {
+        close();
+    }
+
+    bool close(std::string* error_msg = NULL);
+
+protected:
+    void get_posting_lists(const uint8_t* keys, size_t count,
+                           std::string* buffers,
+                           const uint8_t** hashes, size_t* lengths);
+
+private:
+    HmSearchMapped(int hash_bits, int max_error, void* map, size_t map_size,
+                   bool populated)
+        : HmSearchSorted(hash_bits, max_error)
+        , _map(map)
+        , _map_size(map_size)
+        , _populated(populated)
+        { }
+
+    bool check_layout(const MappedHeader* header, std::string* error_msg);
+
+    void* _map;
+    size_t _map_size;
+
+    // Set if the whole file was read into memory when mapped
+    bool _populated;
+};
+
+
+/** A database split over several shard databases, each a complete
+ * database of its own.
+ *
+ * The database path holds a manifest with the settings records _hb
+ * and _me, and _sc which holds the number of shards.  The shards are
+ * stored next to it, see shard_path().  Each hash is inserted into
+ * one shard, chosen from a hash of its bytes, and lookups query all
+ * shards concurrently and merge their results.
+ */
+class HmSearchSharded : public HmSearch
+{
+public:
+    /** Return the path of a shard of the sharded database at path:
+     * the shard number is inserted before the file extension, so
+     * that Kyoto Cabinet still recognises the database type.
+     */
+    static std::string shard_path(const std::string& path, unsigned shard);
+
+    /** Open the shards of the sharded database at path, checking
+     * that they have the settings from its manifest.  Returns NULL on
+     * errors.
+     */
+    static HmSearch* open_shards(const std::string& path, unsigned shards,
+                                 unsigned hash_bits, unsigned max_error,
+                                 OpenMode mode, const OpenOptions& options,
+                                 std::string* error_msg);
+
+    ~HmSearchSharded();
+
+    unsigned hash_bits() const { return _shards[0]->hash_bits(); }
+    unsigned max_error() const { return _shards[0]->max_error(); }
+
+    bool insert(const hash_string& hash,
+                std::string* error_msg = NULL);
+
+    bool insert_batch(const std::vector<hash_string>& hashes,
+                      std::string* error_msg = NULL);
+
+    bool set_write_buffer(size_t max_hashes,
+                          std::string* error_msg = NULL);
+
+    bool flush(std::string* error_msg = NULL);
+
+    bool lookup(const hash_string& query,
+                LookupResultList& result,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup(const hash_string& query,
+                LookupCallback& callback,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup_batch(const std::vector<hash_string>& queries,
+                      std::vector<LookupResultList>& results,
+                      int max_error = -1,
+                      std::string* error_msg = NULL);
+
+    bool lookup_nearest(const hash_string& query,
+                        size_t k,
+                        LookupResultList& result,
+                        int max_error = -1,
+                        std::string* error_msg = NULL);
+
+    void set_lookup_threads(int threads);
+    void set_result_cache(size_t max_bytes);
+    LookupStats get_lookup_stats();
+    void reset_lookup_stats();
+    CacheStats get_cache_stats();
+
+    bool close(std::string* error_msg = NULL);
+
+    void dump();
+
+private:
+    /** Work done on one shard by a fanned-out call.
+     */
+    struct ShardTask : public kyotocabinet::TaskQueue::Task {
+        ShardTask() : shard(NULL), latch(NULL), ok(true) {}
+        virtual ~ShardTask() {}
+        virtual void run() = 0;
+
+        HmSearch* shard;
+        LookupLatch* latch;
+        bool ok;
+        std::string error;
+    };
+
+    struct InsertTask;
+    struct LookupTask;
+    struct BatchTask;
+    struct NearestTask;
+
+    /** The thread pool running the shard tasks.
+     */
+    class ShardQueue : public kyotocabinet::TaskQueue {
+    public:
+        void do_task(Task* task);
+    };
+
+    HmSearchSharded(const std::vector<HmSearch*>& shards);
+
+    unsigned get_shard(const uint8_t* hash) const;
+    bool run_tasks(const std::vector<ShardTask*>& tasks, std::string* error_msg);
+
+    std::vector<HmSearch*> _shards;
+    ShardQueue* _queue;
+};
+
+
+/** Check that hash_bits and max_error are valid database settings.
+ */
+bool check_settings(unsigned hash_bits, unsigned max_error,
+                    std::string* error_msg);
+
+
+/** Choose a bit permutation that spreads the information in a sample
+ * of hashes evenly over the partitions, see
+ * PartitionLayout::set_permutation().
+ */
+void choose_permutation(unsigned hash_bits, unsigned max_error,
+                        const std::vector<HmSearch::hash_string>& sample,
+                        std::vector<uint16_t>& permutation);
+
+/** Read the settings records of a database.  id_bits is set to 0
+ * unless it is a compact database, chunks describes the posting list
+ * chunks (with entries set to 0 unless it is a chunked database), and
+ * permutation is left empty unless the database has a partition bit
+ * permutation.
+ */
+bool read_settings(kyotocabinet::BasicDB* db,
+                   unsigned long* hash_bits, unsigned long* max_error,
+                   unsigned long* id_bits, ChunkFormat* chunks,
+                   std::vector<uint16_t>* permutation,
+                   std::string* error_msg);
+
+// Size of the chunk count at the start of partition records in
+// chunked databases
+#define CHUNK_HEADER_BYTES 4
+
+static inline uint32_t get_chunk_count(const char* head)
+{
+    const uint8_t* p = (const uint8_t*) head;
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+static inline void put_chunk_count(char* head, uint32_t count)
+{
+    head[0] = count >> 24;
+    head[1] = count >> 16;
+    head[2] = count >> 8;
+    head[3] = count;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __HMSEARCH_IMPL_H_INCLUDED__
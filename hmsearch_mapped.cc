@@ -0,0 +1,416 @@
+/* HmSearch hash lookup library - memory-mapped database engine
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <memory>
+
+#include "hmsearch_impl.h"
+
+const char HmSearchMapped::magic[8] = { 'H', 'M', 'S', 'E', 'A', 'R', 'C', 'H' };
+
+static inline uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~uint64_t(7);
+}
+
+
+/** Writes posting lists to their place in the exported file.
+ */
+class MappedFileWriter : public PartitionDirectory::Writer
+{
+public:
+    MappedFileWriter(int fd, uint64_t arena_offset)
+        : _fd(fd), _arena_offset(arena_offset)
+        { }
+
+    bool write(uint64_t offset, const char* data, size_t length,
+               std::string* error_msg) {
+        return write_at(_arena_offset + offset, data, length, error_msg);
+    }
+
+    bool write_at(uint64_t offset, const void* data, size_t length,
+                  std::string* error_msg) {
+        const char* p = (const char*) data;
+
+        while (length > 0) {
+            ssize_t n = pwrite(_fd, p, length, offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                *error_msg = strerror(errno);
+                return false;
+            }
+            p += n;
+            offset += n;
+            length -= n;
+        }
+
+        return true;
+    }
+
+private:
+    int _fd;
+    uint64_t _arena_offset;
+};
+
+
+bool HmSearch::export_mapped(const std::string& path,
+                             const std::string& mapped_path,
+                             std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    std::auto_ptr<kyotocabinet::PolyDB> db(new kyotocabinet::PolyDB);
+    if (!db.get()) {
+        *error_msg = "out of memory";
+        return false;
+    }
+
+    if (!db->open(path, kyotocabinet::BasicDB::OREADER)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    unsigned long hash_bits, max_error, id_bits;
+    ChunkFormat chunks;
+    std::vector<uint16_t> permutation;
+    if (!read_settings(db.get(), &hash_bits, &max_error, &id_bits,
+                       &chunks, &permutation, error_msg)) {
+        return false;
+    }
+
+    if (id_bits) {
+        *error_msg = "compact databases can't be exported";
+        return false;
+    }
+
+    std::string shards;
+    if (db->get("_sc", &shards)) {
+        *error_msg = "sharded databases can't be exported, export each shard instead";
+        return false;
+    }
+
+    int partitions = (max_error + 3) / 2;
+    int partition_bits = ceil((double)hash_bits / partitions);
+    int partition_bytes = (partition_bits + 7) / 8 + 1;
+
+    PartitionDirectory dir(partitions, partition_bytes, chunks);
+    if (!dir.read(db.get(), error_msg)) {
+        return false;
+    }
+
+    std::vector<PartitionDirectory::Partition>& index = dir.partitions();
+
+    // Lay out the file: header, partition headers, then the values and
+    // offsets of each partition and finally the arena
+    HmSearchMapped::MappedHeader header;
+    std::vector<HmSearchMapped::MappedPartition> parts(partitions);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HmSearchMapped::magic, sizeof(header.magic));
+    header.byte_order = HmSearchMapped::byte_order;
+    header.version = HmSearchMapped::version;
+    header.hash_bits = hash_bits;
+    header.max_error = max_error;
+    header.partitions = partitions;
+    header.partition_bytes = partition_bytes;
+
+    uint64_t offset = sizeof(header) + partitions * sizeof(HmSearchMapped::MappedPartition);
+
+    if (!permutation.empty()) {
+        header.permutation_offset = offset;
+        offset = align8(offset + permutation.size() * sizeof(uint16_t));
+    }
+
+    for (int p = 0; p < partitions; p++) {
+        parts[p].count = index[p].offsets.size() - 1;
+        parts[p].values_offset = offset;
+        offset = align8(offset + parts[p].count * partition_bytes);
+        parts[p].offsets_offset = offset;
+        offset += index[p].offsets.size() * sizeof(uint64_t);
+    }
+
+    header.arena_offset = align8(offset);
+    header.arena_length = dir.arena_length();
+
+    // Write to a temporary file which replaces any existing file when
+    // complete, so processes that have the old file mapped are not
+    // disturbed.
+    std::string tmp_path = mapped_path + ".tmp";
+
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    MappedFileWriter writer(fd, header.arena_offset);
+    bool ok = (writer.write_at(0, &header, sizeof(header), error_msg)
+               && writer.write_at(sizeof(header), &parts[0],
+                                  partitions * sizeof(HmSearchMapped::MappedPartition),
+                                  error_msg));
+
+    if (ok && !permutation.empty()) {
+        ok = writer.write_at(header.permutation_offset, &permutation[0],
+                             permutation.size() * sizeof(uint16_t), error_msg);
+    }
+
+    for (int p = 0; ok && p < partitions; p++) {
+        ok = (writer.write_at(parts[p].values_offset,
+                              index[p].values.empty() ? NULL : &index[p].values[0],
+                              index[p].values.size(), error_msg)
+              && writer.write_at(parts[p].offsets_offset, &index[p].offsets[0],
+                                 index[p].offsets.size() * sizeof(uint64_t), error_msg));
+    }
+
+    ok = ok && dir.copy_posting_lists(db.get(), &writer, error_msg);
+
+    if (ok && ftruncate(fd, header.arena_offset + header.arena_length) != 0) {
+        *error_msg = strerror(errno);
+        ok = false;
+    }
+
+    if (ok && fsync(fd) != 0) {
+        *error_msg = strerror(errno);
+        ok = false;
+    }
+
+    if (::close(fd) != 0 && ok) {
+        *error_msg = strerror(errno);
+        ok = false;
+    }
+
+    if (ok && rename(tmp_path.c_str(), mapped_path.c_str()) != 0) {
+        *error_msg = strerror(errno);
+        ok = false;
+    }
+
+    if (!ok) {
+        unlink(tmp_path.c_str());
+    }
+
+    return ok;
+}
+
+
+bool HmSearchMapped::is_mapped_file(const std::string& path)
+{
+    char buf[sizeof(magic)];
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    bool mapped = (fread(buf, sizeof(buf), 1, f) == 1
+                   && memcmp(buf, magic, sizeof(magic)) == 0);
+    fclose(f);
+
+    return mapped;
+}
+
+
+HmSearchMapped* HmSearchMapped::map_file(const std::string& path, bool populate,
+                                         std::string* error_msg)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+
+    if ((size_t) st.st_size < sizeof(MappedHeader)) {
+        *error_msg = "truncated mapped database";
+        ::close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ,
+                     MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) {
+        *error_msg = strerror(errno);
+        return NULL;
+    }
+
+    const MappedHeader* header = (const MappedHeader*) map;
+
+    if (memcmp(header->magic, magic, sizeof(magic)) != 0
+        || header->byte_order != byte_order
+        || header->version != version) {
+        *error_msg = "unsupported mapped database format";
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if (!check_settings(header->hash_bits, header->max_error, error_msg)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    std::auto_ptr<HmSearchMapped> hm(
+        new HmSearchMapped(header->hash_bits, header->max_error, map, st.st_size,
+                           populate));
+    if (!hm.get()) {
+        *error_msg = "out of memory";
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if (!hm->check_layout(header, error_msg)) {
+        return NULL;
+    }
+
+    return hm.release();
+}
+
+
+bool HmSearchMapped::check_layout(const MappedHeader* header, std::string* error_msg)
+{
+    const uint8_t* base = (const uint8_t*) _map;
+
+    if (header->partitions != (uint32_t) _partitions
+        || header->partition_bytes != (uint32_t) _partition_bytes
+        || sizeof(MappedHeader) + _partitions * sizeof(MappedPartition) > _map_size
+        || header->arena_offset > _map_size
+        || header->arena_length > _map_size - header->arena_offset) {
+        *error_msg = "corrupt mapped database";
+        return false;
+    }
+
+    const MappedPartition* parts = (const MappedPartition*) (base + sizeof(MappedHeader));
+    _views.resize(_partitions);
+
+    for (int p = 0; p < _partitions; p++) {
+        uint64_t count = parts[p].count;
+
+        if (parts[p].values_offset > _map_size
+            || count > (_map_size - parts[p].values_offset) / _partition_bytes
+            || parts[p].offsets_offset > _map_size
+            || (parts[p].offsets_offset & 7)
+            || count + 1 > (_map_size - parts[p].offsets_offset) / sizeof(uint64_t)) {
+            *error_msg = "corrupt mapped database";
+            return false;
+        }
+
+        _views[p].values = base + parts[p].values_offset;
+        _views[p].offsets = (const uint64_t*) (base + parts[p].offsets_offset);
+        _views[p].count = count;
+
+        // Posting lists are located by subtracting adjacent offsets,
+        // so they must never decrease or run past the arena
+        const uint64_t* offsets = _views[p].offsets;
+        for (uint64_t i = 0; i < count; i++) {
+            if (offsets[i] > offsets[i + 1]) {
+                *error_msg = "corrupt mapped database";
+                return false;
+            }
+        }
+
+        if (offsets[count] > header->arena_length) {
+            *error_msg = "corrupt mapped database";
+            return false;
+        }
+    }
+
+    if (header->permutation_offset) {
+        if (header->permutation_offset > _map_size
+            || (size_t) _hash_bits > (_map_size - header->permutation_offset) / sizeof(uint16_t)) {
+            *error_msg = "corrupt mapped database";
+            return false;
+        }
+
+        const uint16_t* bits = (const uint16_t*) (base + header->permutation_offset);
+        std::vector<uint16_t> permutation(bits, bits + _hash_bits);
+        std::vector<bool> seen(_hash_bits);
+
+        for (int i = 0; i < _hash_bits; i++) {
+            if (permutation[i] >= _hash_bits || seen[permutation[i]]) {
+                *error_msg = "corrupt mapped database";
+                return false;
+            }
+            seen[permutation[i]] = true;
+        }
+
+        set_permutation(permutation);
+    }
+
+    _arena = base + header->arena_offset;
+    _open = true;
+    return true;
+}
+
+
+void HmSearchMapped::get_posting_lists(const uint8_t* keys, size_t count,
+                                       std::string* buffers,
+                                       const uint8_t** hashes, size_t* lengths)
+{
+    HmSearchSorted::get_posting_lists(keys, count, buffers, hashes, lengths);
+
+    if (_populated) {
+        return;
+    }
+
+    // Finding the posting lists only touches the partition values.
+    // Ask the kernel to read all the lists at once, before they are
+    // counted, so their page faults don't stall one after another.
+    static const uintptr_t page_mask = ~(uintptr_t(sysconf(_SC_PAGESIZE)) - 1);
+
+    for (size_t i = 0; i < count; i++) {
+        if (hashes[i] && lengths[i] > 0) {
+            uintptr_t start = uintptr_t(hashes[i]) & page_mask;
+            uintptr_t end = uintptr_t(hashes[i]) + lengths[i];
+
+            madvise((void*) start, end - start, MADV_WILLNEED);
+        }
+    }
+}
+
+
+bool HmSearchMapped::close(std::string* error_msg)
+{
+    if (error_msg) {
+        *error_msg = "";
+    }
+
+    if (_map) {
+        munmap(_map, _map_size);
+        _map = NULL;
+    }
+
+    _open = false;
+    _views.clear();
+    _arena = NULL;
+
+    return true;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,451 @@
+/* HmSearch hash lookup library - in-memory database engine
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "hmsearch_impl.h"
+
+/** First directory pass: collects the partition values and the size
+ * of their posting lists, including any full chunks.
+ */
+class PartitionDirectory::SizeVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    SizeVisitor(PartitionDirectory* dir, std::vector<std::vector<uint64_t> >& sizes)
+        : _dir(dir), _sizes(sizes)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        if (_dir->partition_record(kbuf, ksiz)) {
+            uint64_t size = vsiz;
+            if (_dir->_chunks.entries) {
+                if (vsiz < CHUNK_HEADER_BYTES) {
+                    return NOP;
+                }
+                size = vsiz - CHUNK_HEADER_BYTES
+                    + uint64_t(get_chunk_count(vbuf)) * _dir->_chunks.bytes();
+            }
+
+            Partition& p = _dir->_index[(uint8_t) kbuf[1]];
+            p.values.insert(p.values.end(), kbuf + 2, kbuf + ksiz);
+            _sizes[(uint8_t) kbuf[1]].push_back(size);
+        }
+        return NOP;
+    }
+
+private:
+    PartitionDirectory* _dir;
+    std::vector<std::vector<uint64_t> >& _sizes;
+};
+
+
+/** Second directory pass: passes each posting list on to the writer.
+ * The full chunks of a chunked posting list are written in chunk
+ * order, followed by the tail from the partition record.
+ */
+class PartitionDirectory::CopyVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    CopyVisitor(PartitionDirectory* dir, Writer* writer, std::string* error_msg)
+        : _dir(dir), _writer(writer), _error_msg(error_msg), _ok(true), _written(0)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        if (!_ok) {
+            return NOP;
+        }
+
+        if (_dir->partition_record(kbuf, ksiz)) {
+            uint64_t chunks = 0;
+            if (_dir->_chunks.entries) {
+                if (vsiz < CHUNK_HEADER_BYTES) {
+                    return NOP;
+                }
+                chunks = get_chunk_count(vbuf);
+                vbuf += CHUNK_HEADER_BYTES;
+                vsiz -= CHUNK_HEADER_BYTES;
+            }
+
+            write(kbuf, chunks * _dir->_chunks.bytes(), vbuf, vsiz, true);
+        }
+        else if (_dir->chunk_record(kbuf, ksiz)) {
+            uint64_t chunk = get_chunk_count(kbuf + ksiz - CHUNK_HEADER_BYTES);
+
+            _chunk.resize(_dir->_chunks.bytes());
+            if (!_dir->_chunks.decode(vbuf, vsiz, &_chunk[0])) {
+                *_error_msg = "invalid posting list chunk";
+                _ok = false;
+                return NOP;
+            }
+
+            write(kbuf, chunk * _chunk.size(), (const char*) &_chunk[0], _chunk.size(), false);
+        }
+        return NOP;
+    }
+
+    bool ok() const { return _ok; }
+
+    uint64_t written() const { return _written; }
+
+private:
+    /** Write part of the posting list of a partition key at position
+     * in it.  A tail must end the posting list.
+     */
+    void write(const char* key, uint64_t position, const char* data, size_t length,
+               bool tail) {
+        long i = _dir->find_value(key);
+
+        if (i < 0) {
+            *_error_msg = "database changed while reading it";
+            _ok = false;
+            return;
+        }
+
+        const Partition& p = _dir->_index[(uint8_t) key[1]];
+        uint64_t size = p.offsets[i + 1] - p.offsets[i];
+
+        if (tail ? position + length != size : position + length > size) {
+            *_error_msg = "database changed while reading it";
+            _ok = false;
+        }
+        else if (!_writer->write(p.offsets[i] + position, data, length, _error_msg)) {
+            _ok = false;
+        }
+        else {
+            _written += length;
+        }
+    }
+
+    PartitionDirectory* _dir;
+    Writer* _writer;
+    std::string* _error_msg;
+    bool _ok;
+    uint64_t _written;
+    std::vector<uint8_t> _chunk;
+};
+
+
+/** Orders value indices by the fixed-length values they refer to.
+ */
+struct ValueLess {
+    ValueLess(const std::vector<uint8_t>& v, int l) : values(v), length(l) {}
+
+    bool operator()(size_t a, size_t b) const {
+        return memcmp(&values[a * length], &values[b * length], length) < 0;
+    }
+
+    const std::vector<uint8_t>& values;
+    int length;
+};
+
+
+bool PartitionDirectory::read(kyotocabinet::BasicDB* db, std::string* error_msg)
+{
+    std::vector<std::vector<uint64_t> > sizes(_partitions);
+
+    _index.assign(_partitions, Partition());
+
+    SizeVisitor visitor(this, sizes);
+    if (!db->iterate(&visitor, false)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    // Sort the values in each partition and lay out their posting
+    // lists in the same order in the arena
+    _arena_length = 0;
+
+    for (int p = 0; p < _partitions; p++) {
+        Partition& part = _index[p];
+        size_t count = sizes[p].size();
+
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), ValueLess(part.values, _partition_bytes));
+
+        std::vector<uint8_t> values(count * _partition_bytes);
+        part.offsets.resize(count + 1);
+
+        for (size_t i = 0; i < count; i++) {
+            memcpy(&values[i * _partition_bytes],
+                   &part.values[order[i] * _partition_bytes], _partition_bytes);
+            part.offsets[i] = _arena_length;
+            _arena_length += sizes[p][order[i]];
+        }
+        part.offsets[count] = _arena_length;
+
+        part.values.swap(values);
+    }
+
+    return true;
+}
+
+
+bool PartitionDirectory::copy_posting_lists(kyotocabinet::BasicDB* db, Writer* writer,
+                                            std::string* error_msg)
+{
+    CopyVisitor visitor(this, writer, error_msg);
+
+    if (!db->iterate(&visitor, false)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (!visitor.ok()) {
+        return false;
+    }
+
+    // Catches chunks that were missing or added since read()
+    if (visitor.written() != _arena_length) {
+        *error_msg = "database changed while reading it";
+        return false;
+    }
+
+    return true;
+}
+
+
+long PartitionDirectory::find_value(const char* key) const
+{
+    const Partition& p = _index[(uint8_t) key[1]];
+
+    return find_partition_value(p.values.empty() ? NULL : &p.values[0],
+                                p.offsets.size() - 1, _partition_bytes,
+                                (const uint8_t*) key + 2);
+}
+
+
+/** Read the leading 64 bits of a value as a big-endian number, which
+ * orders the same way as memcmp() on the value.
+ */
+static inline uint64_t value_prefix(const uint8_t* value, int bytes)
+{
+    uint64_t prefix = 0;
+    for (int i = 0; i < 8; i++) {
+        prefix = (prefix << 8) | (i < bytes ? value[i] : 0);
+    }
+    return prefix;
+}
+
+
+long find_partition_value(const uint8_t* values, uint64_t count,
+                          int value_bytes, const uint8_t* value)
+{
+    long low = 0;
+    long high = (long) count - 1;
+
+    // The values in a partition are spread fairly evenly, so start by
+    // interpolating on their leading bits to narrow the range down
+    // quickly, and finish with a binary search.
+    uint64_t target = value_prefix(value, value_bytes);
+
+    for (int step = 0; step < 4 && high - low > 16; step++) {
+        uint64_t low_prefix = value_prefix(values + low * value_bytes, value_bytes);
+        uint64_t high_prefix = value_prefix(values + high * value_bytes, value_bytes);
+
+        if (target < low_prefix || target > high_prefix) {
+            return -1;
+        }
+
+        if (low_prefix == high_prefix) {
+            break;
+        }
+
+        long mid = low + (long) ((double) (target - low_prefix) / (high_prefix - low_prefix)
+                                 * (high - low));
+        int cmp = memcmp(values + mid * value_bytes, value, value_bytes);
+
+        if (cmp == 0) {
+            return mid;
+        }
+        else if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    while (low <= high) {
+        long mid = low + (high - low) / 2;
+        int cmp = memcmp(values + mid * value_bytes, value, value_bytes);
+
+        if (cmp == 0) {
+            return mid;
+        }
+        else if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+
+bool HmSearchSorted::insert(const hash_string& hash,
+                            std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+
+    *error_msg = "database is read-only";
+    return false;
+}
+
+
+bool HmSearchSorted::insert_batch(const std::vector<hash_string>& hashes,
+                                  std::string* error_msg)
+{
+    return insert(hash_string(), error_msg);
+}
+
+
+bool HmSearchSorted::set_write_buffer(size_t max_hashes,
+                                      std::string* error_msg)
+{
+    // Nothing is ever buffered
+    if (error_msg) {
+        *error_msg = "";
+    }
+    return true;
+}
+
+
+bool HmSearchSorted::flush(std::string* error_msg)
+{
+    if (error_msg) {
+        *error_msg = "";
+    }
+    return true;
+}
+
+
+void HmSearchSorted::dump()
+{
+    for (int p = 0; p < (int) _views.size(); p++) {
+        const PartitionView& view = _views[p];
+
+        for (uint64_t i = 0; i < view.count; i++) {
+            std::cout << "Partition "
+                      << p
+                      << format_hexhash(hash_string(view.values + i * _partition_bytes,
+                                                    _partition_bytes))
+                      << '\n';
+
+            for (uint64_t n = view.offsets[i]; n + _hash_bytes <= view.offsets[i + 1];
+                 n += _hash_bytes) {
+                std::cout << "    "
+                          << format_hexhash(hash_string(_arena + n, _hash_bytes))
+                          << '\n';
+            }
+            std::cout << '\n';
+        }
+    }
+}
+
+
+bool HmSearchSorted::get_posting_list(const uint8_t* key, std::string& buffer,
+                                      const uint8_t** hashes, size_t* length)
+{
+    const PartitionView& view = _views[key[1]];
+
+    long i = find_partition_value(view.values, view.count, _partition_bytes, key + 2);
+    if (i < 0) {
+        return false;
+    }
+
+    *hashes = _arena + view.offsets[i];
+    *length = view.offsets[i + 1] - view.offsets[i];
+    return true;
+}
+
+
+/** Copies posting lists into the in-memory arena.
+ */
+class HmSearchMemory::ArenaWriter : public PartitionDirectory::Writer
+{
+public:
+    ArenaWriter(std::vector<uint8_t>& arena)
+        : _arena(arena)
+        { }
+
+    bool write(uint64_t offset, const char* data, size_t length,
+               std::string* error_msg) {
+        memcpy(&_arena[offset], data, length);
+        return true;
+    }
+
+private:
+    std::vector<uint8_t>& _arena;
+};
+
+
+bool HmSearchMemory::load(kyotocabinet::BasicDB* db, const ChunkFormat& chunks,
+                          std::string* error_msg)
+{
+    PartitionDirectory dir(_partitions, _partition_bytes, chunks);
+
+    if (!dir.read(db, error_msg)) {
+        return false;
+    }
+
+    _arena_buffer.resize(dir.arena_length());
+
+    ArenaWriter writer(_arena_buffer);
+    if (!dir.copy_posting_lists(db, &writer, error_msg)) {
+        return false;
+    }
+
+    dir.partitions().swap(_index);
+
+    _arena = _arena_buffer.empty() ? NULL : &_arena_buffer[0];
+    _views.resize(_partitions);
+
+    for (int p = 0; p < _partitions; p++) {
+        _views[p].values = _index[p].values.empty() ? NULL : &_index[p].values[0];
+        _views[p].offsets = &_index[p].offsets[0];
+        _views[p].count = _index[p].offsets.size() - 1;
+    }
+
+    _open = true;
+    return true;
+}
+
+
+bool HmSearchMemory::close(std::string* error_msg)
+{
+    if (error_msg) {
+        *error_msg = "";
+    }
+
+    _open = false;
+    _views.clear();
+    _arena = NULL;
+    std::vector<PartitionDirectory::Partition>().swap(_index);
+    std::vector<uint8_t>().swap(_arena_buffer);
+
+    return true;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,567 @@
+/* HmSearch hash lookup library - sharded database engine
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "hmsearch_impl.h"
+
+/** Inserts the hashes routed to one shard.
+ */
+struct HmSearchSharded::InsertTask : public ShardTask {
+    void run() {
+        ok = hashes.empty() || shard->insert_batch(hashes, &error);
+    }
+
+    std::vector<hash_string> hashes;
+};
+
+
+/** Looks up a query in one shard.
+ */
+struct HmSearchSharded::LookupTask : public ShardTask {
+    LookupTask(const hash_string* q, int e) : query(q), max_error(e) {}
+
+    void run() {
+        ok = shard->lookup(*query, result, max_error, &error, &stats);
+    }
+
+    const hash_string* query;
+    int max_error;
+    LookupResultList result;
+    LookupStats stats;
+};
+
+
+/** Looks up a batch of queries in one shard.
+ */
+struct HmSearchSharded::BatchTask : public ShardTask {
+    BatchTask(const std::vector<hash_string>* q, int e) : queries(q), max_error(e) {}
+
+    void run() {
+        ok = shard->lookup_batch(*queries, results, max_error, &error);
+    }
+
+    const std::vector<hash_string>* queries;
+    int max_error;
+    std::vector<LookupResultList> results;
+};
+
+
+/** Finds the closest hashes to a query in one shard.
+ */
+struct HmSearchSharded::NearestTask : public ShardTask {
+    NearestTask(const hash_string* q, size_t n, int e) : query(q), k(n), max_error(e) {}
+
+    void run() {
+        ok = shard->lookup_nearest(*query, k, result, max_error, &error);
+    }
+
+    const hash_string* query;
+    size_t k;
+    int max_error;
+    LookupResultList result;
+};
+
+
+/** Orders lookup results by increasing distance.
+ */
+struct DistanceLess {
+    bool operator()(const HmSearch::LookupResult& a,
+                    const HmSearch::LookupResult& b) const {
+        return a.distance < b.distance;
+    }
+};
+
+
+std::string HmSearchSharded::shard_path(const std::string& path, unsigned shard)
+{
+    char number[20];
+    snprintf(number, sizeof(number), ".%u", shard);
+
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    size_t base = slash == std::string::npos ? 0 : slash + 1;
+
+    if (dot == std::string::npos || dot <= base) {
+        return path + number;
+    }
+
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+
+HmSearch* HmSearchSharded::open_shards(const std::string& path, unsigned shards,
+                                       unsigned hash_bits, unsigned max_error,
+                                       OpenMode mode, const OpenOptions& options,
+                                       std::string* error_msg)
+{
+    std::vector<HmSearch*> opened;
+
+    for (unsigned i = 0; i < shards; i++) {
+        std::string shard = shard_path(path, i);
+        HmSearch* hm = open(shard, mode, options, error_msg);
+
+        if (hm && (hm->hash_bits() != hash_bits || hm->max_error() != max_error)) {
+            *error_msg = "settings differ from the manifest";
+            delete hm;
+            hm = NULL;
+        }
+
+        if (!hm) {
+            *error_msg = shard + ": " + *error_msg;
+            for (size_t j = 0; j < opened.size(); j++) {
+                delete opened[j];
+            }
+            return NULL;
+        }
+
+        opened.push_back(hm);
+    }
+
+    return new HmSearchSharded(opened);
+}
+
+
+HmSearchSharded::HmSearchSharded(const std::vector<HmSearch*>& shards)
+    : _shards(shards)
+    , _queue(NULL)
+{
+    // The calling thread works on the first shard itself
+    if (_shards.size() > 1) {
+        _queue = new ShardQueue();
+        _queue->start(_shards.size() - 1);
+    }
+}
+
+
+HmSearchSharded::~HmSearchSharded()
+{
+    close();
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        delete _shards[i];
+    }
+}
+
+
+void HmSearchSharded::ShardQueue::do_task(Task* task)
+{
+    ShardTask* st = static_cast<ShardTask*>(task);
+
+    st->run();
+    st->latch->count_down();
+}
+
+
+unsigned HmSearchSharded::get_shard(const uint8_t* hash) const
+{
+    // FNV-1a over the whole hash, since perceptual hashes often have
+    // biased bits
+    uint64_t h = 14695981039346656037ULL;
+    int bytes = hash_bits() / 8;
+
+    for (int i = 0; i < bytes; i++) {
+        h = (h ^ hash[i]) * 1099511628211ULL;
+    }
+
+    return h % _shards.size();
+}
+
+
+/** Run one task per shard, the first one in the calling thread and
+ * the others on the thread pool, and wait for all of them.  The
+ * tasks are still owned by the caller.
+ */
+bool HmSearchSharded::run_tasks(const std::vector<ShardTask*>& tasks,
+                                std::string* error_msg)
+{
+    LookupLatch latch(tasks.size() - 1);
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i]->shard = _shards[i];
+        tasks[i]->latch = &latch;
+    }
+
+    for (size_t i = 1; i < tasks.size(); i++) {
+        if (_queue) {
+            _queue->add_task(tasks[i]);
+        }
+        else {
+            // Closed, let the shards report it
+            tasks[i]->run();
+            latch.count_down();
+        }
+    }
+
+    tasks[0]->run();
+    latch.wait();
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (!tasks[i]->ok) {
+            *error_msg = tasks[i]->error;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool HmSearchSharded::insert(const hash_string& hash,
+                             std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != hash_bits() / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    return _shards[get_shard(hash.data())]->insert(hash, error_msg);
+}
+
+
+bool HmSearchSharded::insert_batch(const std::vector<hash_string>& hashes,
+                                   std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (hashes[i].length() != hash_bits() / 8) {
+            *error_msg = "incorrect hash length";
+            return false;
+        }
+    }
+
+    std::vector<InsertTask*> inserts;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        inserts.push_back(new InsertTask());
+    }
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        inserts[get_shard(hashes[i].data())]->hashes.push_back(hashes[i]);
+    }
+
+    std::vector<ShardTask*> tasks(inserts.begin(), inserts.end());
+    bool ok = run_tasks(tasks, error_msg);
+
+    for (size_t i = 0; i < inserts.size(); i++) {
+        delete inserts[i];
+    }
+
+    return ok;
+}
+
+
+bool HmSearchSharded::set_write_buffer(size_t max_hashes,
+                                       std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    // Each shard gets its share of the buffer
+    size_t shard_hashes = (max_hashes + _shards.size() - 1) / _shards.size();
+    bool ok = true;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string error;
+        if (!_shards[i]->set_write_buffer(shard_hashes, &error) && ok) {
+            *error_msg = error;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+
+bool HmSearchSharded::flush(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    bool ok = true;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string error;
+        if (!_shards[i]->flush(&error) && ok) {
+            *error_msg = error;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+
+bool HmSearchSharded::lookup(const hash_string& query,
+                             LookupResultList& result,
+                             int max_error,
+                             std::string* error_msg,
+                             LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.size() == 1) {
+        return _shards[0]->lookup(query, result, max_error, error_msg, stats);
+    }
+
+    std::vector<LookupTask*> lookups;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        lookups.push_back(new LookupTask(&query, max_error));
+    }
+
+    std::vector<ShardTask*> tasks(lookups.begin(), lookups.end());
+    bool ok = run_tasks(tasks, error_msg);
+
+    for (size_t i = 0; i < lookups.size(); i++) {
+        if (ok) {
+            result.insert(result.end(), lookups[i]->result.begin(), lookups[i]->result.end());
+            if (stats) {
+                stats->add(lookups[i]->stats);
+            }
+        }
+        delete lookups[i];
+    }
+
+    return ok;
+}
+
+
+bool HmSearchSharded::lookup(const hash_string& query,
+                             LookupCallback& callback,
+                             int max_error,
+                             std::string* error_msg,
+                             LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.size() == 1) {
+        return _shards[0]->lookup(query, callback, max_error, error_msg, stats);
+    }
+
+    // The shards are looked up concurrently, so their matches are
+    // collected first and passed to the callback in this thread
+    LookupResultList result;
+    if (!lookup(query, result, max_error, error_msg, stats)) {
+        return false;
+    }
+
+    for (LookupResultList::const_iterator i = result.begin(); i != result.end(); ++i) {
+        if (!callback.match(i->hash.data(), i->distance)) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+bool HmSearchSharded::lookup_batch(const std::vector<hash_string>& queries,
+                                   std::vector<LookupResultList>& results,
+                                   int max_error,
+                                   std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    std::vector<BatchTask*> batches;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        batches.push_back(new BatchTask(&queries, max_error));
+    }
+
+    std::vector<ShardTask*> tasks(batches.begin(), batches.end());
+    bool ok = run_tasks(tasks, error_msg);
+
+    if (ok) {
+        results.resize(queries.size());
+
+        for (size_t i = 0; i < batches.size(); i++) {
+            for (size_t q = 0; q < queries.size(); q++) {
+                const LookupResultList& r = batches[i]->results[q];
+                results[q].insert(results[q].end(), r.begin(), r.end());
+            }
+        }
+    }
+
+    for (size_t i = 0; i < batches.size(); i++) {
+        delete batches[i];
+    }
+
+    return ok;
+}
+
+
+bool HmSearchSharded::lookup_nearest(const hash_string& query,
+                                     size_t k,
+                                     LookupResultList& result,
+                                     int max_error,
+                                     std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    std::vector<NearestTask*> nearest;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        nearest.push_back(new NearestTask(&query, k, max_error));
+    }
+
+    std::vector<ShardTask*> tasks(nearest.begin(), nearest.end());
+    bool ok = run_tasks(tasks, error_msg);
+
+    if (ok) {
+        // The k closest of all shards are among the k closest of each
+        LookupResultList merged;
+        for (size_t i = 0; i < nearest.size(); i++) {
+            merged.insert(merged.end(), nearest[i]->result.begin(), nearest[i]->result.end());
+        }
+
+        std::stable_sort(merged.begin(), merged.end(), DistanceLess());
+        if (merged.size() > k) {
+            merged.erase(merged.begin() + k, merged.end());
+        }
+
+        result.insert(result.end(), merged.begin(), merged.end());
+    }
+
+    for (size_t i = 0; i < nearest.size(); i++) {
+        delete nearest[i];
+    }
+
+    return ok;
+}
+
+
+void HmSearchSharded::set_lookup_threads(int threads)
+{
+    for (size_t i = 0; i < _shards.size(); i++) {
+        _shards[i]->set_lookup_threads(threads);
+    }
+}
+
+
+void HmSearchSharded::set_result_cache(size_t max_bytes)
+{
+    // Each shard caches its own share of the matches
+    size_t shard_bytes = (max_bytes + _shards.size() - 1) / _shards.size();
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        _shards[i]->set_result_cache(shard_bytes);
+    }
+}
+
+
+HmSearch::LookupStats HmSearchSharded::get_lookup_stats()
+{
+    LookupStats stats;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        stats.add(_shards[i]->get_lookup_stats());
+    }
+
+    return stats;
+}
+
+
+void HmSearchSharded::reset_lookup_stats()
+{
+    for (size_t i = 0; i < _shards.size(); i++) {
+        _shards[i]->reset_lookup_stats();
+    }
+}
+
+
+HmSearch::CacheStats HmSearchSharded::get_cache_stats()
+{
+    CacheStats stats;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        CacheStats s = _shards[i]->get_cache_stats();
+        stats.hits += s.hits;
+        stats.misses += s.misses;
+        stats.entries += s.entries;
+        stats.bytes += s.bytes;
+    }
+
+    return stats;
+}
+
+
+bool HmSearchSharded::close(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_queue) {
+        _queue->finish();
+        delete _queue;
+        _queue = NULL;
+    }
+
+    // Close all shards even if some of them fail
+    bool ok = true;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string error;
+        if (!_shards[i]->close(&error) && ok) {
+            *error_msg = error;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+
+void HmSearchSharded::dump()
+{
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::cout << "Shard " << i << "\n\n";
+        _shards[i]->dump();
+    }
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/